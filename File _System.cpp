@@ -4,134 +4,2924 @@
 #include <sstream>
 #include <fstream>
 #include <ctime>  
-#include <queue>
+#include <algorithm>
+#include <unordered_map>
+#include <map>
+#include <unordered_set>
+#include <cstdint>
+#include <cstring>
+#include <cstdio>
+#include <cstdlib>
+#include <atomic>
+#include <memory>
+#include <filesystem>
+#include <thread>
+#include <chrono>
+#include <mutex>
+#include <condition_variable>
+#include <coroutine>
+#include <deque>
+#include <functional>
+#include <utility>
 
 using namespace std;
 
+// Self-contained LZ77 codec modelled on the LZ4 block format. Each sequence
+// is a token byte (literal run length in the high nibble, match length - 4
+// in the low nibble, either extended with extra bytes when it reaches 15),
+// the literal bytes, and a 2-byte little-endian offset back into the output.
+// The last sequence carries literals only.
+class LZCodec {
+public:
+    static string compress(const string& input) {
+        const unsigned char* src = reinterpret_cast<const unsigned char*>(input.data());
+        const size_t size = input.size();
+        string out;
+        out.reserve(size / 2 + 16);
+
+        size_t anchor = 0;
+        if (size >= minMatch + lastLiterals) {
+            vector<size_t> table(size_t(1) << hashBits, noPosition);
+            const size_t limit = size - lastLiterals;
+            size_t pos = 0;
+            while (pos + minMatch <= limit) {
+                uint32_t sequence = read32(src + pos);
+                size_t slot = (sequence * 2654435761u) >> (32 - hashBits);
+                size_t candidate = table[slot];
+                table[slot] = pos;
+
+                if (candidate != noPosition && pos - candidate <= maxOffset && read32(src + candidate) == sequence) {
+                    size_t length = minMatch;
+                    while (pos + length < limit && src[candidate + length] == src[pos + length]) ++length;
+                    emitSequence(out, src + anchor, pos - anchor, pos - candidate, length);
+                    pos += length;
+                    anchor = pos;
+                }
+                else {
+                    ++pos;
+                }
+            }
+        }
+
+        emitSequence(out, src + anchor, size - anchor, 0, 0);
+        return out;
+    }
+
+    // Returns false if `input` is malformed or does not inflate to exactly
+    // `rawSize` bytes.
+    static bool decompress(const string& input, string& output, size_t rawSize) {
+        output.clear();
+        output.reserve(rawSize);
+        size_t in = 0;
+        const size_t end = input.size();
+
+        while (in < end) {
+            unsigned char token = input[in++];
+            size_t literals = token >> 4;
+            if (literals == 15 && !readLength(input, in, literals)) return false;
+            if (literals > end - in) return false;
+            output.append(input, in, literals);
+            in += literals;
+            if (in == end) break;
+
+            if (end - in < 2) return false;
+            size_t offset = (unsigned char)input[in] | ((unsigned char)input[in + 1] << 8);
+            in += 2;
+            size_t length = token & 15;
+            if (length == 15 && !readLength(input, in, length)) return false;
+            length += minMatch;
+            if (offset == 0 || offset > output.size() || output.size() + length > rawSize) return false;
+
+            size_t from = output.size() - offset;
+            if (offset >= length) {
+                output.append(output, from, length);
+            }
+            else {
+                for (size_t i = 0; i < length; ++i) output.push_back(output[from + i]);
+            }
+        }
+        return output.size() == rawSize;
+    }
+
+private:
+    static constexpr size_t minMatch = 4;
+    static constexpr size_t lastLiterals = 5;
+    static constexpr size_t maxOffset = 65535;
+    static constexpr int hashBits = 14;
+    static constexpr size_t noPosition = size_t(-1);
+
+    static uint32_t read32(const unsigned char* p) {
+        uint32_t value;
+        memcpy(&value, p, sizeof(value));
+        return value;
+    }
+
+    static void writeLength(string& out, size_t length) {
+        while (length >= 255) {
+            out.push_back((char)255);
+            length -= 255;
+        }
+        out.push_back((char)length);
+    }
+
+    static bool readLength(const string& input, size_t& in, size_t& length) {
+        unsigned char extra;
+        do {
+            if (in >= input.size()) return false;
+            extra = input[in++];
+            length += extra;
+        } while (extra == 255);
+        return true;
+    }
+
+    // A zero `matchLength` writes the trailing literal-only sequence.
+    static void emitSequence(string& out, const unsigned char* literals, size_t literalCount,
+        size_t offset, size_t matchLength) {
+        size_t matchCode = matchLength ? matchLength - minMatch : 0;
+        unsigned char token = (unsigned char)((min(literalCount, size_t(15)) << 4) | min(matchCode, size_t(15)));
+        out.push_back((char)token);
+        if (literalCount >= 15) writeLength(out, literalCount - 15);
+        out.append(reinterpret_cast<const char*>(literals), literalCount);
+        if (!matchLength) return;
+        out.push_back((char)(offset & 0xff));
+        out.push_back((char)(offset >> 8));
+        if (matchCode >= 15) writeLength(out, matchCode - 15);
+    }
+};
+
+// Fixed-size slots carved out of large blocks and recycled through a free
+// list, so a tree of many small files costs one heap allocation per few
+// thousand nodes. Blocks are kept for the life of the process.
+class NodeSlab {
+public:
+    explicit NodeSlab(size_t slotSize)
+        : slotSize(max(slotSize, sizeof(void*))), next(nullptr), end(nullptr), freeList(nullptr), inUse(0) {}
+
+    void* allocate() {
+        lock_guard<mutex> hold(guard);
+        ++inUse;
+        if (freeList) {
+            void* slot = freeList;
+            freeList = *static_cast<void**>(slot);
+            return slot;
+        }
+        if (next == end) {
+            blocks.emplace_back(new char[slotSize * slotsPerBlock]);
+            next = blocks.back().get();
+            end = next + slotSize * slotsPerBlock;
+        }
+        void* slot = next;
+        next += slotSize;
+        return slot;
+    }
+
+    void release(void* slot) {
+        if (!slot) return;
+        lock_guard<mutex> hold(guard);
+        *static_cast<void**>(slot) = freeList;
+        freeList = slot;
+        --inUse;
+    }
+
+    size_t slotsInUse() const { return inUse; }
+    size_t reservedBytes() const { return blocks.size() * slotSize * slotsPerBlock; }
+
+private:
+    static constexpr size_t slotsPerBlock = 4096;
+
+    size_t slotSize;
+    vector<unique_ptr<char[]>> blocks;
+    char* next;
+    char* end;
+    void* freeList;
+    size_t inUse;
+    mutex guard;
+};
+
+class Node;
+
+// One entry of a directory's child index: a node of a treap ordered by
+// child name, with priorities taken from a hash of the name. Entries are
+// reference counted and never changed while shared, so a copied directory
+// shares its whole index with the original and a change to either copies
+// only the O(log n) entries on the way down.
+struct IndexEntry {
+    Node* child;
+    IndexEntry* left;
+    IndexEntry* right;
+    uint32_t priority;
+    uint32_t refs;
+
+    static void* operator new(size_t size);
+    static void operator delete(void* slot);
+};
+
+// What a node names as its parent: the directory itself rather than one of
+// its versions. Every version of a directory shares one anchor and `live`
+// is the version in the live tree (null once the directory is removed), so
+// copying a directory moves its children over by updating one pointer.
+// Counted by the directory's versions and the nodes naming it as parent.
+struct DirAnchor {
+    Node* live;
+    size_t refs;
+};
+
+// Owning pointer to a record that only some nodes need. Copying the owner
+// copies the record, so two nodes never share one.
+template <typename T>
+class Extension {
+public:
+    Extension() : record(nullptr) {}
+    Extension(const Extension& other) : record(other.record ? new T(*other.record) : nullptr) {}
+    Extension& operator=(const Extension& other) {
+        if (this != &other) {
+            T* copy = other.record ? new T(*other.record) : nullptr;
+            delete record;
+            record = copy;
+        }
+        return *this;
+    }
+    ~Extension() {
+        delete record;
+    }
+
+    void create() {
+        if (!record) record = new T();
+    }
+
+    void reset() {
+        delete record;
+        record = nullptr;
+    }
+
+    T* operator->() const {
+        return record;
+    }
+
+    T& operator*() const {
+        return *record;
+    }
+
+    explicit operator bool() const {
+        return record != nullptr;
+    }
+
+private:
+    T* record;
+};
+
+// State only directories have.
+struct DirInfo {
+    // The children keyed by name, shared between the versions of the
+    // directory (see ChildIndex), and the anchor every version shares.
+    IndexEntry* children = nullptr;
+    size_t childCount = 0;
+    DirAnchor* anchor = nullptr;
+
+    // Totals for everything below the directory (the directory itself is
+    // not counted). Kept up to date incrementally by FileSystem::applyUsage.
+    size_t subtreeBytes = 0;
+    size_t subtreeFiles = 0;
+    size_t subtreeDirs = 0;
+
+    // Quota on the subtree totals above; 0 means unlimited.
+    size_t quotaBytes = 0;
+    size_t quotaInodes = 0;
+};
+
+// State only symbolic links have.
+struct LinkInfo {
+    string target;
+
+    // Memoized target node, valid while `resolvedGeneration` matches the
+    // FileSystem's namespace generation.
+    Node* resolvedTarget = nullptr;
+    unsigned long resolvedGeneration = 0;
+};
+
+// Fields are grouped by size so the flags share one word; state that only
+// directories or symlinks need lives in their extension records, which
+// keeps the slab slot of a plain file small.
 class Node {
 public:
     string name;
-    bool isDirectory;
     string content;
-    Node* firstChild;
-    Node* nextSibling;
-    Node* parent;
+    string owner;
+
+    // The directory this node sits in, named through its anchor so that a
+    // copied directory takes its children along without touching them. Only
+    // meaningful in the live tree: snapshots never read parent pointers.
+    DirAnchor* parent;
+
+    // Set exactly for directories and for symlinks respectively.
+    Extension<DirInfo> dirInfo;
+    Extension<LinkInfo> linkInfo;
+
+    time_t createdAt;
+    time_t modifiedAt;
+    time_t accessedAt;
+    size_t fileSize;
+
+    // Set exactly when isChunked is: the content lives in the FileSystem's
+    // BlockStore as the listed chunks and `content` is empty.
+    Extension<vector<uint64_t>> chunks;
+
+    // When isPacked is set, the content is an extent in the FileSystem's
+    // ExtentStore and `content` is empty. Contents short enough for the
+    // string's own buffer stay inline in the node's slot.
+    uint64_t extent;
+
+    // Snapshot bookkeeping. A node stamped with an epoch older than the
+    // newest snapshot is shared with it and must not change; the live tree
+    // replaces it with a copy and `forward` points at that copy.
+    unsigned long epoch;
+    Node* forward;
+
+    // Identity that survives path copies (cloneNode copies it) and
+    // transaction rollback; a fresh node or a cp copy gets a new one.
+    uint64_t inode;
+
+    // Demand paging. A file whose content was evicted has `isSpilled` set
+    // and its stored bytes at spillOffset in the spill file. `hasSpillCopy`
+    // stays set after a fault while that copy is still current, so a clean
+    // file can be evicted again without a write. Resident files with
+    // content are kept on the FileSystem's LRU list.
+    uint64_t spillOffset;
+    size_t spillLength;
+    Node* lruPrev;
+    Node* lruNext;
+
+    // Effective rwx bits of this node for user `maskUser`, valid while
+    // `maskGeneration` matches the FileSystem's permission generation.
+    unsigned long maskGeneration;
+    uint32_t maskUser;
+    unsigned char accessMask;
+
+    unsigned int permissions;
+    bool isDirectory;
+    bool isSymLink;
+
+    // When set, `content` holds LZCodec output and `fileSize` is the
+    // logical (inflated) size.
+    bool isCompressed;
+    bool isChunked;
+    bool isPacked;
+    bool isSpilled;
+    bool hasSpillCopy;
+
+    static void* operator new(size_t size);
+    static void operator delete(void* slot);
+
+    Node(string name, bool isDirectory)
+        : name(name), owner("root"), parent(nullptr),
+        createdAt(0), modifiedAt(0), accessedAt(time(nullptr)), fileSize(0), extent(0), epoch(0), forward(nullptr),
+        inode(0), spillOffset(0), spillLength(0), lruPrev(nullptr), lruNext(nullptr),
+        maskGeneration(0), maskUser(0), accessMask(0), permissions(0755), isDirectory(isDirectory), isSymLink(false),
+        isCompressed(false), isChunked(false), isPacked(false), isSpilled(false), hasSpillCopy(false) {
+        if (isDirectory) dirInfo.create();
+    }
+};
+
+NodeSlab& nodeSlab() {
+    static NodeSlab slab(sizeof(Node));
+    return slab;
+}
+
+void* Node::operator new(size_t) {
+    return nodeSlab().allocate();
+}
+
+void Node::operator delete(void* slot) {
+    nodeSlab().release(slot);
+}
+
+NodeSlab& entrySlab() {
+    static NodeSlab slab(sizeof(IndexEntry));
+    return slab;
+}
+
+void* IndexEntry::operator new(size_t) {
+    return entrySlab().allocate();
+}
+
+void IndexEntry::operator delete(void* slot) {
+    entrySlab().release(slot);
+}
+
+// Operations on a child index rooted at an IndexEntry* owned by one
+// directory version. Functions taking the root by reference may change it;
+// they first copy every shared entry they are about to modify (own()), so
+// other versions holding the same entries never see the change.
+class ChildIndex {
+public:
+    // Another directory version starts holding `root`.
+    static IndexEntry* share(IndexEntry* root) {
+        if (root) ++root->refs;
+        return root;
+    }
+
+    // Drops one holder of `root`, freeing the entries no version holds.
+    static void release(IndexEntry* root) {
+        changed();
+        releaseEntry(root);
+    }
+
+    static Node* find(const IndexEntry* root, const string& name) {
+        while (root) {
+            const string& key = root->child->name;
+            if (name < key) root = root->left;
+            else if (key < name) root = root->right;
+            else return root->child;
+        }
+        return nullptr;
+    }
+
+    static Node* first(const IndexEntry* root) {
+        if (!root) return nullptr;
+        while (root->left) root = root->left;
+        return root->child;
+    }
+
+    // The child following `name` in name order; `name` need not be present.
+    static Node* after(const IndexEntry* root, const string& name) {
+        Node* found = nullptr;
+        while (root) {
+            if (name < root->child->name) {
+                found = root->child;
+                root = root->left;
+            }
+            else {
+                root = root->right;
+            }
+        }
+        return found;
+    }
+
+    // Iteration state for walkers: `trail` holds the entries still to be
+    // visited on the way back up, innermost last, so the next child is
+    // trail.back() and advancing past it is amortized O(1). Valid while
+    // changeCount() is what it was when the trail was built.
+    static void seek(const IndexEntry* root, const string& name, vector<const IndexEntry*>& trail) {
+        while (root) {
+            if (root->child->name < name) {
+                root = root->right;
+            }
+            else {
+                trail.push_back(root);
+                root = root->left;
+            }
+        }
+    }
+
+    static void descendLeft(const IndexEntry* entry, vector<const IndexEntry*>& trail) {
+        for (; entry; entry = entry->left) trail.push_back(entry);
+    }
+
+    static uint64_t changeCount() {
+        return changes.load(memory_order_relaxed);
+    }
+
+    // In name order.
+    template <typename Fn>
+    static void forEach(const IndexEntry* root, Fn fn) {
+        if (!root) return;
+        forEach(root->left, fn);
+        fn(root->child);
+        forEach(root->right, fn);
+    }
+
+    // Adds `child`, whose name must not be in the index yet.
+    static void insert(IndexEntry*& root, Node* child);
+
+    // Points the entry for `child->name` at `child`.
+    static void replace(IndexEntry*& root, Node* child) {
+        changed();
+        IndexEntry** slot = &root;
+        while (*slot) {
+            own(*slot);
+            const string& key = (*slot)->child->name;
+            if (child->name < key) slot = &(*slot)->left;
+            else if (key < child->name) slot = &(*slot)->right;
+            else {
+                (*slot)->child = child;
+                return;
+            }
+        }
+    }
+
+    static void erase(IndexEntry*& root, const string& name) {
+        changed();
+        IndexEntry** slot = &root;
+        while (*slot) {
+            own(*slot);
+            const string& key = (*slot)->child->name;
+            if (name < key) slot = &(*slot)->left;
+            else if (key < name) slot = &(*slot)->right;
+            else {
+                IndexEntry* entry = *slot;
+                *slot = merge(entry->left, entry->right);
+                delete entry;
+                return;
+            }
+        }
+    }
+
+private:
+    static inline atomic<uint64_t> changes{ 0 };
+
+    static void changed() {
+        changes.fetch_add(1, memory_order_relaxed);
+    }
+
+    static uint32_t priorityOf(const string& name) {
+        return (uint32_t)hash<string>()(name);
+    }
+
+    static void releaseEntry(IndexEntry* entry) {
+        if (!entry || --entry->refs) return;
+        releaseEntry(entry->left);
+        releaseEntry(entry->right);
+        delete entry;
+    }
+
+    // Makes the entry in `slot` private to the holder of the slot.
+    static void own(IndexEntry*& slot) {
+        if (slot->refs == 1) return;
+        IndexEntry* copy = new IndexEntry(*slot);
+        copy->refs = 1;
+        share(copy->left);
+        share(copy->right);
+        --slot->refs;
+        slot = copy;
+    }
+
+    // Splits the private entry `entry` into the names below and from `name`.
+    static void split(IndexEntry* entry, const string& name, IndexEntry*& below, IndexEntry*& from) {
+        if (!entry) {
+            below = from = nullptr;
+            return;
+        }
+        if (entry->child->name < name) {
+            if (entry->right) own(entry->right);
+            split(entry->right, name, entry->right, from);
+            below = entry;
+        }
+        else {
+            if (entry->left) own(entry->left);
+            split(entry->left, name, below, entry->left);
+            from = entry;
+        }
+    }
+
+    // Joins two treaps whose names are all below / all above each other,
+    // taking over the caller's references to both.
+    static IndexEntry* merge(IndexEntry* low, IndexEntry* high) {
+        if (!low) return high;
+        if (!high) return low;
+        if (low->priority >= high->priority) {
+            own(low);
+            low->right = merge(low->right, high);
+            return low;
+        }
+        own(high);
+        high->left = merge(low, high->left);
+        return high;
+    }
+};
+
+void ChildIndex::insert(IndexEntry*& root, Node* child) {
+    changed();
+    IndexEntry* entry = new IndexEntry{ child, nullptr, nullptr, priorityOf(child->name), 1 };
+    IndexEntry** slot = &root;
+    while (*slot && (*slot)->priority > entry->priority) {
+        own(*slot);
+        slot = child->name < (*slot)->child->name ? &(*slot)->left : &(*slot)->right;
+    }
+    if (*slot) own(*slot);
+    split(*slot, child->name, entry->left, entry->right);
+    *slot = entry;
+}
+
+// Explicit-stack depth-first walker over the tree, children in name order.
+// Each node is reported twice: once on the way down (PreOrder) and once on
+// the way back up (PostOrder). The walk state lives entirely in the cursor,
+// so a caller can stop calling next() at any point and resume later, and
+// deep trees never touch the call stack.
+class TreeCursor {
+public:
+    enum Phase { PreOrder, PostOrder };
+
+    TreeCursor(Node* start = nullptr) {
+        reset(start);
+    }
+
+    void reset(Node* start) {
+        stack.clear();
+        trail.clear();
+        pruned = false;
+        if (start) stack.push_back({ start, nullptr, 0, 0, false, false });
+    }
+
+    // Advances to the next event. Returns false once the walk is finished.
+    // The next sibling is found before a node is descended into, so the
+    // caller may take that node out of its parent's index and delete it
+    // right away. The walk then finds its place again by name.
+    bool next(Node*& node, Phase& phase) {
+        while (!stack.empty()) {
+            Frame& top = stack.back();
+            if (!top.entered) {
+                top.entered = true;
+                pruned = false;
+                node = top.node;
+                phase = PreOrder;
+                return true;
+            }
+            if (!top.expanded) {
+                top.expanded = true;
+                top.trailStart = trail.size();
+                top.version = ChildIndex::changeCount();
+                if (!pruned && top.node->isDirectory) ChildIndex::descendLeft(top.node->dirInfo->children, trail);
+                top.nextChild = trail.size() > top.trailStart ? trail.back()->child : nullptr;
+            }
+            if (top.nextChild) {
+                if (top.version != ChildIndex::changeCount()) {
+                    trail.resize(top.trailStart);
+                    ChildIndex::seek(top.node->dirInfo->children, top.nextChild->name, trail);
+                    top.version = ChildIndex::changeCount();
+                    if (trail.size() == top.trailStart) {
+                        top.nextChild = nullptr;
+                        continue;
+                    }
+                }
+                const IndexEntry* entry = trail.back();
+                trail.pop_back();
+                ChildIndex::descendLeft(entry->right, trail);
+                Node* child = entry->child;
+                top.nextChild = trail.size() > top.trailStart ? trail.back()->child : nullptr;
+#if defined(__GNUC__)
+                if (top.nextChild) __builtin_prefetch(top.nextChild);
+#endif
+                stack.push_back({ child, nullptr, 0, 0, false, false });
+                continue;
+            }
+            node = top.node;
+            phase = PostOrder;
+            trail.resize(top.trailStart);
+            stack.pop_back();
+            return true;
+        }
+        return false;
+    }
+
+    // Only meaningful right after a PreOrder event: the children of that
+    // node are not visited, but its PostOrder event is still delivered.
+    void skipChildren() {
+        pruned = true;
+    }
+
+    bool done() const {
+        return stack.empty();
+    }
+
+    // Nodes from the starting node down to the current one (inclusive).
+    void currentPath(vector<Node*>& path) const {
+        path.clear();
+        for (const Frame& frame : stack) path.push_back(frame.node);
+    }
+
+private:
+    // A frame's part of `trail` starts at trailStart and is current as of
+    // the index change count in `version`.
+    struct Frame {
+        Node* node;
+        Node* nextChild;
+        size_t trailStart;
+        uint64_t version;
+        bool entered;
+        bool expanded;
+    };
+
+    vector<Frame> stack;
+    vector<const IndexEntry*> trail;
+    bool pruned;
+};
+
+enum class Visit { Continue, SkipChildren, Stop };
+
+// Visitor front end for TreeCursor. `pre` decides whether to descend into a
+// node, `post` runs after all of its children have been visited.
+template <typename PreFn, typename PostFn>
+void walkTree(Node* start, PreFn pre, PostFn post) {
+    TreeCursor cursor(start);
+    Node* node;
+    TreeCursor::Phase phase;
+    while (cursor.next(node, phase)) {
+        if (phase == TreeCursor::PreOrder) {
+            Visit action = pre(node);
+            if (action == Visit::Stop) return;
+            if (action == Visit::SkipChildren) cursor.skipChildren();
+        }
+        else {
+            post(node);
+        }
+    }
+}
+
+template <typename PreFn>
+void walkTree(Node* start, PreFn pre) {
+    walkTree(start, pre, [](Node*) {});
+}
+
+// Content-addressed, reference-counted store for file chunks. Identical
+// chunks are kept once; each block is LZ-compressed when that shrinks it.
+class BlockStore {
+public:
+    BlockStore(): nextKey(1), storedBytes(0), uniqueBytes(0), logicalBytes(0) {}
+
+    // Splits `data` into content-defined chunks with a Gear rolling hash, so
+    // an insertion early in a file only changes the chunks around it.
+    static void chunk(const string& data, vector<pair<size_t, size_t>>& pieces) {
+        static const vector<uint64_t> gear = makeGearTable();
+        pieces.clear();
+        size_t start = 0;
+        uint64_t hash = 0;
+        for (size_t i = 0; i < data.size(); ++i) {
+            hash = (hash << 1) + gear[(unsigned char)data[i]];
+            size_t length = i + 1 - start;
+            if ((length >= minChunk && (hash & boundaryMask) == 0) || length >= maxChunk) {
+                pieces.push_back({ start, length });
+                start = i + 1;
+                hash = 0;
+            }
+        }
+        if (start < data.size()) pieces.push_back({ start, data.size() - start });
+    }
+
+    // Stores (or references) one chunk and returns its key. Keys are handed
+    // out in sequence; blocks with the same fingerprint share a bucket, so
+    // freeing one never hides another from a later lookup.
+    uint64_t put(const char* data, size_t size) {
+        uint64_t hash = fingerprint(data, size);
+        string packed;
+        bool packedReady = false;
+
+        vector<uint64_t>& bucket = byFingerprint[hash];
+        for (uint64_t key : bucket) {
+            Block& block = blocks.at(key);
+            if (block.rawSize == size) {
+                bool same;
+                if (!block.compressed) {
+                    same = memcmp(block.data.data(), data, size) == 0;
+                }
+                else {
+                    // The codec is deterministic, so equal input means equal output.
+                    if (!packedReady) {
+                        packed = LZCodec::compress(string(data, size));
+                        packedReady = true;
+                    }
+                    same = block.data == packed;
+                }
+                if (same) {
+                    ++block.refs;
+                    logicalBytes += size;
+                    return key;
+                }
+            }
+        }
+
+        if (!packedReady) packed = LZCodec::compress(string(data, size));
+        uint64_t key = nextKey++;
+        bucket.push_back(key);
+        Block& block = blocks[key];
+        block.fingerprint = hash;
+        block.rawSize = size;
+        block.refs = 1;
+        block.compressed = packed.size() < size;
+        block.data = block.compressed ? move(packed) : string(data, size);
+        block.data.shrink_to_fit();
+        storedBytes += block.data.size();
+        uniqueBytes += size;
+        logicalBytes += size;
+        return key;
+    }
+
+    void addRef(uint64_t key) {
+        Block& block = blocks.at(key);
+        ++block.refs;
+        logicalBytes += block.rawSize;
+    }
+
+    void release(uint64_t key) {
+        auto found = blocks.find(key);
+        if (found == blocks.end()) return;
+        Block& block = found->second;
+        logicalBytes -= block.rawSize;
+        if (--block.refs == 0) {
+            storedBytes -= block.data.size();
+            uniqueBytes -= block.rawSize;
+            auto bucket = byFingerprint.find(block.fingerprint);
+            bucket->second.erase(find(bucket->second.begin(), bucket->second.end(), key));
+            if (bucket->second.empty()) byFingerprint.erase(bucket);
+            blocks.erase(found);
+        }
+    }
+
+    void append(uint64_t key, string& out) const {
+        const Block& block = blocks.at(key);
+        if (!block.compressed) {
+            out += block.data;
+            return;
+        }
+        string raw;
+        LZCodec::decompress(block.data, raw, block.rawSize);
+        out += raw;
+    }
+
+    void write(uint64_t key, ostream& out) const {
+        const Block& block = blocks.at(key);
+        if (!block.compressed) {
+            out.write(block.data.data(), block.data.size());
+            return;
+        }
+        string raw;
+        LZCodec::decompress(block.data, raw, block.rawSize);
+        out.write(raw.data(), raw.size());
+    }
+
+    size_t blockCount() const { return blocks.size(); }
+    size_t stored() const { return storedBytes; }
+    size_t unique() const { return uniqueBytes; }
+    size_t logical() const { return logicalBytes; }
+
+private:
+    static constexpr size_t minChunk = 2048;
+    static constexpr size_t maxChunk = 65536;
+    static constexpr uint64_t boundaryMask = (1u << 13) - 1;  // ~8 KiB average
+
+    struct Block {
+        string data;
+        uint64_t fingerprint;
+        size_t rawSize;
+        size_t refs;
+        bool compressed;
+    };
+
+    unordered_map<uint64_t, Block> blocks;
+    unordered_map<uint64_t, vector<uint64_t>> byFingerprint;
+    uint64_t nextKey;
+    size_t storedBytes;
+    size_t uniqueBytes;
+    size_t logicalBytes;
+
+    static vector<uint64_t> makeGearTable() {
+        vector<uint64_t> table(256);
+        uint64_t state = 0x9e3779b97f4a7c15ull;
+        for (uint64_t& entry : table) {
+            state += 0x9e3779b97f4a7c15ull;
+            uint64_t z = state;
+            z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+            z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+            entry = z ^ (z >> 31);
+        }
+        return table;
+    }
+
+    static uint64_t fingerprint(const char* data, size_t size) {
+        uint64_t hash = 0xcbf29ce484222325ull;
+        for (size_t i = 0; i < size; ++i) {
+            hash ^= (unsigned char)data[i];
+            hash *= 0x100000001b3ull;
+        }
+        return hash;
+    }
+};
+
+// Packs small file contents into shared pages so they cost no allocation of
+// their own. A handle holds the page number in its high 32 bits and the
+// offset in the low ones. Each extent starts with a reference count, so
+// copies of a file share it. A page is reused once all of its extents are
+// released; holes in a partly used page are not.
+class ExtentStore {
+public:
+    static constexpr size_t pageSize = 65536;
+
+    ExtentStore(): current(0), liveBytes(0) {}
+
+    uint64_t store(const char* data, size_t length) {
+        size_t need = footprint(length);
+        if (pages.empty() || pages[current].used + need > pageSize) openPage();
+        Page& page = pages[current];
+        uint64_t handle = (uint64_t)current << 32 | page.used;
+        char* extent = page.bytes.get() + page.used;
+        setRefs(extent, 1);
+        memcpy(extent + sizeof(uint32_t), data, length);
+        page.used += need;
+        page.live += need;
+        liveBytes += length;
+        return handle;
+    }
+
+    const char* data(uint64_t handle) const {
+        return extentAt(handle) + sizeof(uint32_t);
+    }
+
+    void addRef(uint64_t handle) {
+        char* extent = extentAt(handle);
+        setRefs(extent, refs(extent) + 1);
+    }
+
+    void release(uint64_t handle, size_t length) {
+        char* extent = extentAt(handle);
+        uint32_t left = refs(extent) - 1;
+        setRefs(extent, left);
+        if (left) return;
+        uint32_t number = (uint32_t)(handle >> 32);
+        Page& page = pages[number];
+        page.live -= footprint(length);
+        liveBytes -= length;
+        if (page.live == 0) {
+            page.used = 0;
+            if (number != current) freePages.push_back(number);
+        }
+    }
+
+    size_t pageCount() const { return pages.size(); }
+    size_t live() const { return liveBytes; }
+
+private:
+    struct Page {
+        unique_ptr<char[]> bytes;
+        size_t used;
+        size_t live;
+    };
+
+    vector<Page> pages;
+    vector<uint32_t> freePages;
+    uint32_t current;
+    size_t liveBytes;
+
+    // Reference count plus content, rounded up to keep counts aligned.
+    static size_t footprint(size_t length) {
+        return (sizeof(uint32_t) + length + 3) & ~size_t(3);
+    }
+
+    char* extentAt(uint64_t handle) const {
+        return pages[handle >> 32].bytes.get() + (uint32_t)handle;
+    }
+
+    static uint32_t refs(const char* extent) {
+        uint32_t count;
+        memcpy(&count, extent, sizeof(count));
+        return count;
+    }
+
+    static void setRefs(char* extent, uint32_t count) {
+        memcpy(extent, &count, sizeof(count));
+    }
+
+    void openPage() {
+        if (!freePages.empty()) {
+            current = freePages.back();
+            freePages.pop_back();
+            return;
+        }
+        pages.push_back({ unique_ptr<char[]>(new char[pageSize]), 0, 0 });
+        current = (uint32_t)(pages.size() - 1);
+    }
+};
+
+// Append-only host file that holds evicted file contents. Regions of
+// rewritten or deleted files are not reused; the file is discarded when
+// spilling is turned off.
+class SpillFile {
+    fstream file;
+    string path;
+    uint64_t endOffset;
+
+public:
+    SpillFile() : endOffset(0) {}
+
+    ~SpillFile() {
+        if (isOpen()) close();
+    }
+
+    // Creates `hostPath`, which must not exist yet: close() deletes the
+    // file, so it must never be one that was there before.
+    bool open(const string& hostPath) {
+        FILE* created = fopen(hostPath.c_str(), "wbx");
+        if (!created) return false;
+        fclose(created);
+        // Unbuffered: every append and read moves one whole content anyway,
+        // and a failed write must not leave bytes behind to flush later.
+        file.rdbuf()->pubsetbuf(nullptr, 0);
+        file.open(hostPath, ios::in | ios::out | ios::binary);
+        if (!file) {
+            std::remove(hostPath.c_str());
+            return false;
+        }
+        path = hostPath;
+        endOffset = 0;
+        return true;
+    }
+
+    void close() {
+        file.close();
+        std::remove(path.c_str());
+        path.clear();
+        endOffset = 0;
+    }
+
+    bool isOpen() const {
+        return file.is_open();
+    }
+
+    const string& hostPath() const {
+        return path;
+    }
+
+    uint64_t size() const {
+        return endOffset;
+    }
+
+    // Writes `data` at the end and sets `offset` to where it went. False if
+    // it did not reach the file, in which case nothing is used up.
+    bool append(const string& data, uint64_t& offset) {
+        file.clear();
+        file.seekp((streamoff)endOffset);
+        if (!file.write(data.data(), data.size()).flush()) return false;
+        offset = endOffset;
+        endOffset += data.size();
+        return true;
+    }
+
+    bool read(uint64_t offset, size_t length, string& out) {
+        out.resize(length);
+        if (!length) return true;
+        file.clear();
+        file.seekg((streamoff)offset);
+        return file.read(&out[0], length).gcount() == (streamsize)length;
+    }
+};
+
+// Change notification delivered to watchers. `from` is only set for moves.
+struct FsEvent {
+    enum Kind { Create, Modify, Delete, Move, Attrib, Overflow };
+    Kind kind;
+    string path;
+    string from;
+    bool isDirectory;
+};
+
+// Bounded single-producer/single-consumer event queue. The file system is
+// the only producer and the watcher the only consumer: `tail` is written
+// by the producer alone and `head` by the consumer alone, so neither side
+// takes a lock. The last free slot is reserved for an Overflow marker,
+// and events arriving while the marker is still queued are dropped.
+class EventRing {
+    vector<FsEvent> slots;
+    size_t mask;
+    atomic<size_t> head;
+    atomic<size_t> tail;
+    atomic<size_t> dropped;
+    size_t markerAt;
+    bool hasMarker;
+
+    void publish(size_t at, const FsEvent& event) {
+        slots[at & mask] = event;
+        tail.store(at + 1, memory_order_release);
+    }
+
+public:
+    explicit EventRing(size_t capacity) : mask(0), head(0), tail(0), dropped(0), markerAt(0), hasMarker(false) {
+        size_t size = 2;
+        while (size < capacity) size <<= 1;
+        slots.resize(size);
+        mask = size - 1;
+    }
+
+    // Producer side. A modify of the same path as the newest unconsumed
+    // event is folded into it. If the consumer takes that event meanwhile,
+    // it did so after the change being reported, so nothing is lost.
+    bool push(const FsEvent& event) {
+        size_t t = tail.load(memory_order_relaxed);
+        size_t h = head.load(memory_order_acquire);
+        if (event.kind == FsEvent::Modify && t != h) {
+            const FsEvent& last = slots[(t - 1) & mask];
+            if (last.kind == FsEvent::Modify && last.path == event.path) return true;
+        }
+        if (t - h + 1 < slots.size()) {
+            publish(t, event);
+            return true;
+        }
+        if (!hasMarker || markerAt < h) {
+            publish(t, { FsEvent::Overflow, "", "", false });
+            markerAt = t;
+            hasMarker = true;
+        }
+        dropped.fetch_add(1, memory_order_relaxed);
+        return false;
+    }
+
+    // Consumer side. Slots are copied out, never moved, because the
+    // producer may still be comparing against the newest one.
+    bool pop(FsEvent& event) {
+        size_t h = head.load(memory_order_relaxed);
+        if (h == tail.load(memory_order_acquire)) return false;
+        event = slots[h & mask];
+        head.store(h + 1, memory_order_release);
+        return true;
+    }
+
+    size_t size() const {
+        return tail.load(memory_order_acquire) - head.load(memory_order_acquire);
+    }
+
+    size_t droppedEvents() const {
+        return dropped.load(memory_order_relaxed);
+    }
+};
+
+// Lazily started coroutine for background jobs. Awaiting a Task runs it
+// and resumes the awaiter when it finishes, so a job is built from smaller
+// coroutines; the outermost one is resumed by the Executor.
+class Task {
+public:
+    struct promise_type {
+        coroutine_handle<> continuation;
+
+        Task get_return_object() {
+            return Task(coroutine_handle<promise_type>::from_promise(*this));
+        }
+
+        suspend_always initial_suspend() noexcept { return {}; }
+
+        // Hands control straight to the awaiting coroutine, if any.
+        struct FinalAwaiter {
+            bool await_ready() noexcept { return false; }
+            coroutine_handle<> await_suspend(coroutine_handle<promise_type> finished) noexcept {
+                coroutine_handle<> next = finished.promise().continuation;
+                return next ? next : noop_coroutine();
+            }
+            void await_resume() noexcept {}
+        };
+
+        FinalAwaiter final_suspend() noexcept { return {}; }
+        void return_void() {}
+        void unhandled_exception() { terminate(); }
+    };
+
+    Task() : handle(nullptr) {}
+    Task(Task&& other) noexcept : handle(exchange(other.handle, nullptr)) {}
+    Task(const Task&) = delete;
+
+    Task& operator=(Task&& other) noexcept {
+        if (this != &other) {
+            if (handle) handle.destroy();
+            handle = exchange(other.handle, nullptr);
+        }
+        return *this;
+    }
+
+    ~Task() {
+        if (handle) handle.destroy();
+    }
+
+    bool done() const {
+        return !handle || handle.done();
+    }
+
+    coroutine_handle<> start() const {
+        return handle;
+    }
+
+    bool await_ready() const noexcept { return false; }
+
+    coroutine_handle<> await_suspend(coroutine_handle<> awaiter) noexcept {
+        handle.promise().continuation = awaiter;
+        return handle;
+    }
+
+    void await_resume() const noexcept {}
+
+private:
+    explicit Task(coroutine_handle<promise_type> handle) : handle(handle) {}
+
+    coroutine_handle<promise_type> handle;
+};
+
+// One worker thread running posted work in order. stop() lets it finish
+// the queue, including anything posted meanwhile, and joins it.
+class Executor {
+    mutex guard;
+    condition_variable wake;
+    deque<function<void()>> queue;
+    bool stopping;
+    thread worker;
+
+    void run() {
+        while (true) {
+            function<void()> work;
+            {
+                unique_lock<mutex> hold(guard);
+                wake.wait(hold, [this] { return stopping || !queue.empty(); });
+                if (queue.empty()) return;
+                work = move(queue.front());
+                queue.pop_front();
+            }
+            work();
+        }
+    }
+
+public:
+    Executor() : stopping(false) {
+        worker = thread([this] { run(); });
+    }
+
+    ~Executor() {
+        stop();
+    }
+
+    void post(function<void()> work) {
+        {
+            lock_guard<mutex> hold(guard);
+            queue.push_back(move(work));
+        }
+        wake.notify_one();
+    }
+
+    bool hasPending() {
+        lock_guard<mutex> hold(guard);
+        return !queue.empty();
+    }
+
+    void stop() {
+        {
+            lock_guard<mutex> hold(guard);
+            stopping = true;
+        }
+        wake.notify_one();
+        if (worker.joinable()) worker.join();
+    }
+};
+
+// Progress of a background job: entries (or, for load, bytes) done so far
+// out of the total.
+typedef function<void(size_t done, size_t total)> ProgressFn;
+
+class FileSystem {
+private:
+    Node* root;
+    Node* currentDirectory;
+
+    // Read-only point-in-time views, mounted under /.snapshots/<name>. They
+    // share every node the live tree has not changed since they were taken.
+    struct Snapshot {
+        Node* root;
+        unsigned long epoch;
+        time_t createdAt;
+    };
+
+    map<string, Snapshot> snapshots;
+    unsigned long liveEpoch;
+    unsigned long frozenBelow;
+
+    // Parent pointers inside a snapshot belong to the live tree, so while
+    // the working directory is inside one its ancestry is tracked here.
+    string cwdSnapshot;
+    vector<Node*> snapshotPath;
+
+    // Set by findNode when the path resolved into a snapshot, plus the
+    // ancestry it walked there.
+    bool lastLookupReadOnly;
+    string lastLookupSnapshot;
+    vector<Node*> lastLookupPath;
+    enum class LookupError { None, SymlinkLoop, PermissionDenied };
+    LookupError lastLookupError;
+
+    // Bumped whenever a name may start resolving to a different node, which
+    // invalidates every memoized symlink target at once.
+    unsigned long namespaceGeneration;
+    static constexpr int maxSymlinkHops = 40;
+    uint64_t nextInode;
+
+    // Session user. Users are interned to small ids so an access mask
+    // cache hit is two integer compares; id 0 is root, which bypasses
+    // every check.
+    enum Access : unsigned char { AccessExecute = 1, AccessWrite = 2, AccessRead = 4 };
+    string sessionUser;
+    uint32_t sessionUserId;
+    unordered_map<string, uint32_t> userIds;
+    unsigned long permGeneration;
+
+    // Watches follow a node, not a path: they match the node with the
+    // watched inode, its direct children, or (recursive) anything below it,
+    // wherever it is moved. `path` tracks where the node is now, for
+    // display, and `removed` is set once it has been deleted.
+    struct Watch {
+        uint64_t inode;
+        string path;
+        bool recursive;
+        bool removed;
+        EventRing ring;
+
+        Watch(uint64_t inode, const string& path, bool recursive)
+            : inode(inode), path(path), recursive(recursive), removed(false), ring(watchQueueSize) {}
+    };
+    static constexpr size_t watchQueueSize = 1024;
+    map<int, unique_ptr<Watch>> watches;
+    int nextWatchId;
+
+    // Where a path walk currently is: the node reached so far and, inside a
+    // snapshot, its ancestry from the snapshot root.
+    struct PathState {
+        Node* node;
+        string snapshot;
+        vector<Node*> trail;
+    };
+
+    struct UsageDelta {
+        long long bytes;
+        long long files;
+        long long dirs;
+    };
+
+    // While bulk mode is on, rollup deltas are parked on the directory they
+    // were applied to and pushed up the tree in one pass by flushRollups().
+    bool deferRollups;
+    unordered_map<Node*, UsageDelta> pendingRollups;
+
+    // Running per-owner counters; every node (directories included) is one
+    // inode charged to its owner.
+    struct OwnerUsage {
+        size_t bytes;
+        size_t inodes;
+    };
+
+    struct Quota {
+        size_t maxBytes;
+        size_t maxInodes;
+    };
+
+    unordered_map<string, OwnerUsage> ownerUsage;
+    unordered_map<string, Quota> ownerQuotas;
+    unordered_set<Node*> quotaDirs;
+
+    // Every "Error:" line goes through fail(), so callers can tell whether
+    // a command failed.
+    size_t failures;
+
+    // Open transaction. `begin` freezes the tree like an unnamed snapshot,
+    // so every change inside it is a path copy and rollback only has to
+    // put the old root back. Rollups and notifications are held until
+    // commit and then applied in one batch.
+    struct Transaction {
+        Node* root;
+        Node* currentDirectory;
+        string cwdSnapshot;
+        vector<Node*> snapshotPath;
+        unsigned long epoch;
+        unsigned long snapshotFrozenBelow;
+        bool deferredRollups;
+        size_t failedChanges;       // failed commands that change the tree
+        unordered_map<string, OwnerUsage> ownerUsage;
+        unordered_map<string, Quota> ownerQuotas;
+        unordered_set<Node*> quotaDirs;
+        vector<Node*> retired;      // frozen nodes removed during the transaction
+        vector<pair<int, FsEvent>> events;  // by watch id
+        map<int, pair<string, bool>> watchPaths;
+    };
+    unique_ptr<Transaction> txn;
+
+    // Background job: a coroutine that runs on the executor a slice at a
+    // time, under stateLock like any foreground command. Jobs that read
+    // the tree pin the root first (`view`), which freezes it like an
+    // unnamed snapshot, so they see it as it was when they started from
+    // `start` on (which may lie in a snapshot instead). A tree a job is
+    // building or tearing down away from the live tree is `held`.
+    struct Job {
+        int id;
+        string description;
+        string user;
+        uint32_t userId;
+        bool cancellable;
+        bool cancelRequested;
+        size_t done;
+        size_t total;
+        ProgressFn onProgress;
+        Node* view;
+        Node* start;
+        unsigned long viewEpoch;
+        unsigned long changesAtPin;
+        Node* held;
+        vector<Node*> kept;     // frozen nodes rmdir unlinked but may not free
+        chrono::steady_clock::time_point sliceStart;
+        Task task;
+    };
+
+    // Awaited by jobs between units of work. Only suspends when someone
+    // else is waiting for the lock or the slice has used its budget, and
+    // resumes to false once the job has been cancelled.
+    struct Checkpoint {
+        FileSystem& fs;
+        Job& job;
+
+        bool await_ready() { return !fs.shouldYield(job); }
+        void await_suspend(coroutine_handle<> next) { fs.schedule(job, next); }
+        bool await_resume() const { return !job.cancelRequested; }
+    };
+
+    static constexpr chrono::microseconds sliceBudget{2000};
+    static constexpr size_t entriesPerCheckpoint = 4096;
+
+    map<int, unique_ptr<Job>> jobs;
+    int nextJobId;
+    mutex stateLock;
+    atomic<int> foregroundWaiting;
+    condition_variable foregroundDone;  // foregroundWaiting dropped to 0
+    condition_variable jobsChanged;
+    Executor executor;
+
+    // Bumped whenever a node leaves the live tree (copied or unlinked), and
+    // when a snapshot or pin goes away. Releasing a pin skips the orphan
+    // sweep if neither happened meanwhile.
+    unsigned long retiredVersions;
+    unsigned long holderReleases;
+
+    // Files of at least this many bytes are stored compressed when the codec
+    // actually shrinks them; `compress` handles cold files below it. With
+    // dedup on, files that large are chunked into the block store instead.
+    size_t compressThreshold;
+    bool dedupEnabled;
+    BlockStore blockStore;
+
+    // Files longer than the string's inline buffer and up to packLimit
+    // bytes are packed into extents. They are never spilled: one page
+    // holds hundreds of them.
+    size_t packLimit;
+    bool packingEnabled;
+    ExtentStore extents;
+    string packedRead;
+
+    // Tiered storage. While a spill file is open, resident file contents
+    // form an LRU list (most recent at the head) and the tail is written
+    // out whenever residentBytes exceeds memoryCeiling.
+    SpillFile spill;
+    size_t memoryCeiling;
+    size_t residentBytes;
+    size_t residentFiles;
+    size_t spilledFiles;
+    Node* lruHead;
+    Node* lruTail;
+    size_t pageHits;
+    size_t pageFaults;
+    size_t evictions;
+
+    bool onLru(Node* file) const {
+        return file->lruPrev || lruHead == file;
+    }
+
+    void lruUnlink(Node* file) {
+        (file->lruPrev ? file->lruPrev->lruNext : lruHead) = file->lruNext;
+        (file->lruNext ? file->lruNext->lruPrev : lruTail) = file->lruPrev;
+        file->lruPrev = file->lruNext = nullptr;
+    }
+
+    void lruPushFront(Node* file) {
+        file->lruNext = lruHead;
+        (lruHead ? lruHead->lruPrev : lruTail) = file;
+        lruHead = file;
+    }
+
+    // Starts tracking a file whose content is resident. No-op when
+    // spilling is off or there is nothing to page out.
+    void track(Node* file) {
+        if (!spill.isOpen() || file->isSpilled || file->content.empty() || onLru(file)) return;
+        lruPushFront(file);
+        residentBytes += file->content.size();
+        ++residentFiles;
+    }
+
+    // Must run before a tracked file's content is replaced or freed.
+    void untrack(Node* file) {
+        if (file->isSpilled) {
+            file->isSpilled = false;
+            --spilledFiles;
+        }
+        if (!onLru(file)) return;
+        lruUnlink(file);
+        residentBytes -= file->content.size();
+        --residentFiles;
+    }
+
+    // Pages a file out. If its content cannot be written, it stays resident
+    // and on the LRU list.
+    bool evict(Node* file) {
+        if (!file->hasSpillCopy) {
+            if (!spill.append(file->content, file->spillOffset)) return false;
+            file->spillLength = file->content.size();
+            file->hasSpillCopy = true;
+        }
+        lruUnlink(file);
+        residentBytes -= file->content.size();
+        --residentFiles;
+        file->content.clear();
+        file->content.shrink_to_fit();
+        file->isSpilled = true;
+        ++spilledFiles;
+        ++evictions;
+        return true;
+    }
+
+    // Evicts from the cold end until under the ceiling, sparing `keep`.
+    void enforceCeiling(Node* keep) {
+        while (residentBytes > memoryCeiling && lruTail && lruTail != keep) {
+            if (!evict(lruTail)) {
+                fail() << "Error: Unable to write to the spill file; contents stay in memory" << endl;
+                return;
+            }
+        }
+    }
+
+    void noteAccess(Node* file) {
+        if (!onLru(file)) return;
+        ++pageHits;
+        if (file != lruHead) {
+            lruUnlink(file);
+            lruPushFront(file);
+        }
+    }
+
+    // Makes a file's stored bytes resident again. On a failed read the file
+    // stays spilled with no content resident.
+    bool pageIn(Node* file) {
+        if (!file->isSpilled) {
+            noteAccess(file);
+            return true;
+        }
+        if (!spill.read(file->spillOffset, file->spillLength, file->content)) {
+            fail() << "Error: Unable to read '" << file->name << "' back from the spill file" << endl;
+            file->content.clear();
+            return false;
+        }
+        file->isSpilled = false;
+        --spilledFiles;
+        ++pageFaults;
+        track(file);
+        enforceCeiling(file);
+        return true;
+    }
+
+    // Stored bytes of a file without making them resident: a spilled file
+    // is read into `scratch`. Null if that read fails.
+    const string* physicalContent(Node* file, string& scratch) {
+        if (!file->isSpilled) {
+            noteAccess(file);
+            return &file->content;
+        }
+        ++pageFaults;
+        if (!spill.read(file->spillOffset, file->spillLength, scratch)) {
+            fail() << "Error: Unable to read '" << file->name << "' back from the spill file" << endl;
+            return nullptr;
+        }
+        return &scratch;
+    }
+
+    // Inflated copies of recently read compressed files, most recent first.
+    vector<pair<Node*, string>> inflated;
+    static constexpr size_t inflatedCacheSize = 8;
+
+    void forgetInflated(Node* file) {
+        for (size_t i = 0; i < inflated.size(); ++i) {
+            if (inflated[i].first == file) {
+                inflated.erase(inflated.begin() + i);
+                return;
+            }
+        }
+    }
+
+    // Rebuilds the plain bytes of a compressed or chunked file into `raw`,
+    // bypassing the cache.
+    void inflateContent(Node* file, string& raw) {
+        raw.clear();
+        if (file->isPacked) {
+            raw.assign(extents.data(file->extent), file->fileSize);
+            return;
+        }
+        if (file->isChunked) {
+            raw.reserve(file->fileSize);
+            for (uint64_t key : *file->chunks) blockStore.append(key, raw);
+            return;
+        }
+        string scratch;
+        const string* stored = physicalContent(file, scratch);
+        if (!stored) {
+            raw.clear();
+            return;
+        }
+        if (!LZCodec::decompress(*stored, raw, file->fileSize)) {
+            fail() << "Error: Compressed content of '" << file->name << "' is corrupt" << endl;
+            raw.clear();
+        }
+    }
+
+    // Logical content of a file. The reference is only valid until the next
+    // readContent/storeContent call.
+    const string& readContent(Node* file) {
+        file->accessedAt = time(nullptr);
+        if (file->isPacked) {
+            packedRead.assign(extents.data(file->extent), file->fileSize);
+            return packedRead;
+        }
+        if (!file->isCompressed && !file->isChunked) {
+            pageIn(file);
+            return file->content;
+        }
+
+        for (size_t i = 0; i < inflated.size(); ++i) {
+            if (inflated[i].first == file) {
+                if (i) rotate(inflated.begin(), inflated.begin() + i, inflated.begin() + i + 1);
+                return inflated.front().second;
+            }
+        }
+
+        string raw;
+        inflateContent(file, raw);
+        if (inflated.size() == inflatedCacheSize) inflated.pop_back();
+        inflated.insert(inflated.begin(), make_pair(file, move(raw)));
+        return inflated.front().second;
+    }
+
+    // Streams a file's content without building an inflated copy of
+    // chunked files.
+    void writeContent(Node* file, ostream& out) {
+        if (file->isChunked) {
+            file->accessedAt = time(nullptr);
+            for (uint64_t key : *file->chunks) blockStore.write(key, out);
+            return;
+        }
+        if (file->isPacked) {
+            file->accessedAt = time(nullptr);
+            out.write(extents.data(file->extent), file->fileSize);
+            return;
+        }
+        out << readContent(file);
+    }
+
+    void releaseChunks(Node* file) {
+        if (!file->chunks) return;
+        for (uint64_t key : *file->chunks) blockStore.release(key);
+        file->chunks.reset();
+        file->isChunked = false;
+    }
+
+    // Must run before a packed file's size changes.
+    void releaseExtent(Node* file) {
+        if (!file->isPacked) return;
+        extents.release(file->extent, file->fileSize);
+        file->isPacked = false;
+    }
+
+    void storeContent(Node* file, const string& data) {
+        forgetInflated(file);
+        releaseChunks(file);
+        releaseExtent(file);
+        untrack(file);
+        file->hasSpillCopy = false;
+        file->fileSize = data.size();
+        file->accessedAt = time(nullptr);
+        file->isCompressed = false;
+        string packed;
+        if (dedupEnabled && data.size() >= compressThreshold) {
+            vector<pair<size_t, size_t>> pieces;
+            BlockStore::chunk(data, pieces);
+            file->chunks.create();
+            file->chunks->reserve(pieces.size());
+            for (const auto& piece : pieces) {
+                file->chunks->push_back(blockStore.put(data.data() + piece.first, piece.second));
+            }
+            file->content.clear();
+            file->content.shrink_to_fit();
+            file->isChunked = true;
+        }
+        else if (data.size() >= compressThreshold && (packed = LZCodec::compress(data)).size() < data.size()) {
+            file->content = move(packed);
+            file->content.shrink_to_fit();
+            file->isCompressed = true;
+        }
+        else if (packingEnabled && data.size() > string().capacity() && data.size() <= packLimit) {
+            file->extent = extents.store(data.data(), data.size());
+            file->isPacked = true;
+            file->content.clear();
+            file->content.shrink_to_fit();
+        }
+        else {
+            file->content = data;
+        }
+        track(file);
+        enforceCeiling(file);
+    }
+
+    // What attaching `node` (with everything below it) adds to its ancestors.
+    UsageDelta usageOf(Node* node) {
+        if (node->isDirectory) {
+            return { (long long)node->dirInfo->subtreeBytes, (long long)node->dirInfo->subtreeFiles, (long long)node->dirInfo->subtreeDirs + 1 };
+        }
+        return { (long long)node->fileSize, 1, 0 };
+    }
+
+    static UsageDelta negate(const UsageDelta& delta) {
+        return { -delta.bytes, -delta.files, -delta.dirs };
+    }
+
+    static void addUsage(Node* dir, const UsageDelta& delta) {
+        dir->dirInfo->subtreeBytes += delta.bytes;
+        dir->dirInfo->subtreeFiles += delta.files;
+        dir->dirInfo->subtreeDirs += delta.dirs;
+    }
+
+    // True if `dir` or one of its ancestors carries a directory quota.
+    bool underQuota(Node* dir) const {
+        if (quotaDirs.empty()) return false;
+        for (; dir; dir = parentOf(dir)) {
+            if (dir->dirInfo->quotaBytes || dir->dirInfo->quotaInodes) return true;
+        }
+        return false;
+    }
+
+    // Adds `delta` to `dir` and every ancestor of it: O(depth). Deltas below
+    // a quota directory are never parked, so its counters stay exact for
+    // checkQuota without flushing the rest of a bulk load.
+    void applyUsage(Node* dir, const UsageDelta& delta) {
+        if (!dir) return;
+        if (deferRollups && !underQuota(dir)) {
+            UsageDelta& pending = pendingRollups[dir];
+            pending.bytes += delta.bytes;
+            pending.files += delta.files;
+            pending.dirs += delta.dirs;
+            return;
+        }
+        for (Node* node = dir; node; node = parentOf(node)) {
+            addUsage(node, delta);
+        }
+    }
+
+    // Pushes parked deltas up the tree deepest level first, merging them at
+    // each parent so every affected ancestor is updated exactly once.
+    void flushRollups() {
+        if (pendingRollups.empty()) return;
+
+        map<size_t, unordered_map<Node*, UsageDelta>, greater<size_t>> levels;
+        for (const auto& entry : pendingRollups) {
+            size_t depth = 0;
+            for (Node* node = parentOf(entry.first); node; node = parentOf(node)) ++depth;
+            levels[depth][entry.first] = entry.second;
+        }
+        pendingRollups.clear();
+
+        while (!levels.empty()) {
+            auto level = levels.begin();
+            size_t depth = level->first;
+            for (const auto& entry : level->second) {
+                addUsage(entry.first, entry.second);
+                Node* parent = parentOf(entry.first);
+                if (parent) {
+                    UsageDelta& up = levels[depth - 1][parent];
+                    up.bytes += entry.second.bytes;
+                    up.files += entry.second.files;
+                    up.dirs += entry.second.dirs;
+                }
+            }
+            levels.erase(level);
+        }
+    }
+
+    vector<string> tokenize(const string& path) {
+        vector<string> tokens;
+        stringstream ss(path);
+        string token;
+        while (getline(ss, token, '/')) {
+            if (!token.empty()) tokens.push_back(token);
+        }
+        return tokens;
+    }
+
+    
+
+
+    void chargeOwner(const string& owner, long long bytes, long long inodes) {
+        OwnerUsage& usage = ownerUsage[owner];
+        usage.bytes += bytes;
+        usage.inodes += inodes;
+    }
+
+    // Returns false (after printing why) if adding `delta` under `dir` on
+    // behalf of `owner` would break a quota. An empty owner skips the owner
+    // check; `stopAt` ends the directory check early (used by mv, whose
+    // source already counts against the shared ancestors).
+    bool checkQuota(Node* dir, const string& owner, const UsageDelta& delta,
+        const unordered_set<Node*>* stopAt = nullptr) {
+        long long inodes = delta.files + delta.dirs;
+        if (!owner.empty()) {
+            auto quota = ownerQuotas.find(owner);
+            if (quota != ownerQuotas.end()) {
+                const OwnerUsage& usage = ownerUsage[owner];
+                if (quota->second.maxBytes && delta.bytes > 0 &&
+                    usage.bytes + delta.bytes > quota->second.maxBytes) {
+                    fail() << "Error: Byte quota exceeded for owner '" << owner << "'" << endl;
+                    return false;
+                }
+                if (quota->second.maxInodes && inodes > 0 &&
+                    usage.inodes + inodes > quota->second.maxInodes) {
+                    fail() << "Error: Inode quota exceeded for owner '" << owner << "'" << endl;
+                    return false;
+                }
+            }
+        }
+
+        if (quotaDirs.empty()) return true;
+        for (Node* node = dir; node; node = parentOf(node)) {
+            if (stopAt && stopAt->count(node)) break;
+            if (node->dirInfo->quotaBytes && delta.bytes > 0 &&
+                node->dirInfo->subtreeBytes + delta.bytes > node->dirInfo->quotaBytes) {
+                fail() << "Error: Byte quota exceeded for directory '" << node->name << "'" << endl;
+                return false;
+            }
+            if (node->dirInfo->quotaInodes && inodes > 0 &&
+                node->dirInfo->subtreeFiles + node->dirInfo->subtreeDirs + inodes > node->dirInfo->quotaInodes) {
+                fail() << "Error: Inode quota exceeded for directory '" << node->name << "'" << endl;
+                return false;
+            }
+        }
+        return true;
+    }
+
+    bool isFrozen(Node* node) const {
+        return node->epoch < frozenBelow;
+    }
+
+    Node* newNode(const string& name, bool isDirectory, Node* parent) {
+        Node* node = new Node(name, isDirectory);
+        if (isDirectory) node->dirInfo->anchor = new DirAnchor{ node, 1 };
+        setParent(node, parent);
+        node->createdAt = node->modifiedAt = time(nullptr);
+        node->epoch = liveEpoch;
+        node->inode = nextInode++;
+        return node;
+    }
+
+    // Latest live version of a node that may have been copied since the
+    // caller looked it up.
+    static Node* live(Node* node) {
+        while (node && node->forward) node = node->forward;
+        return node;
+    }
+
+    // The directory holding a live node.
+    static Node* parentOf(const Node* node) {
+        return node->parent ? node->parent->live : nullptr;
+    }
+
+    static void releaseAnchor(DirAnchor* anchor) {
+        if (anchor && --anchor->refs == 0) delete anchor;
+    }
+
+    static void setParent(Node* child, Node* dir) {
+        DirAnchor* anchor = dir ? dir->dirInfo->anchor : nullptr;
+        if (anchor) ++anchor->refs;
+        releaseAnchor(child->parent);
+        child->parent = anchor;
+    }
+
+    // Paging state of a node copy: a spilled copy shares the (immutable)
+    // spill region, a resident one joins the LRU list on its own.
+    void adoptPaging(Node* copy) {
+        copy->lruPrev = copy->lruNext = nullptr;
+        if (copy->isSpilled) ++spilledFiles;
+        track(copy);
+        enforceCeiling(copy);
+    }
+
+    // Live copy of a frozen node. A directory copy shares its children and
+    // their index with the original and takes over the anchor, which makes
+    // it the children's parent without touching them.
+    Node* cloneNode(Node* node) {
+        Node* copy = new Node(*node);
+        copy->epoch = liveEpoch;
+        copy->forward = nullptr;
+        node->forward = copy;
+        ++namespaceGeneration;
+        ++retiredVersions;
+        if (copy->chunks) {
+            for (uint64_t key : *copy->chunks) blockStore.addRef(key);
+        }
+        if (copy->isPacked) extents.addRef(copy->extent);
+        adoptPaging(copy);
+        if (copy->parent) ++copy->parent->refs;
+        if (copy->isDirectory) {
+            ChildIndex::share(copy->dirInfo->children);
+            ++copy->dirInfo->anchor->refs;
+            copy->dirInfo->anchor->live = copy;
+        }
+        if (quotaDirs.erase(node)) quotaDirs.insert(copy);
+        // A cwd inside a snapshot must keep pointing at the frozen version.
+        if (currentDirectory == node && cwdSnapshot.empty()) currentDirectory = copy;
+        if (root == node) root = copy;
+        return copy;
+    }
+
+    // Path copying: returns a version of `node` that may be changed without
+    // affecting any snapshot, copying it and its frozen ancestors as needed.
+    Node* makeMutable(Node* node) {
+        if (!isFrozen(node)) return node;
+
+        vector<Node*> frozen;
+        for (Node* current = node; current && isFrozen(current); current = parentOf(current)) {
+            frozen.push_back(current);
+        }
+        Node* parent = parentOf(frozen.back());
+        for (auto it = frozen.rbegin(); it != frozen.rend(); ++it) {
+            Node* copy = cloneNode(*it);
+            if (parent) ChildIndex::replace(parent->dirInfo->children, copy);
+            parent = copy;
+        }
+        return parent;
+    }
+
+    static Node* findChild(Node* dir, const string& name) {
+        return dir->dirInfo ? ChildIndex::find(dir->dirInfo->children, name) : nullptr;
+    }
+
+    static void indexChild(Node* dir, Node* child) {
+        ChildIndex::insert(dir->dirInfo->children, child);
+    }
+
+    static void unindexChild(Node* dir, Node* child) {
+        if (findChild(dir, child->name) == child) ChildIndex::erase(dir->dirInfo->children, child->name);
+    }
 
-    time_t createdAt;
-    time_t modifiedAt;
-    size_t fileSize;
-    string owner;
-    unsigned int permissions;  
-    bool isSymLink;
-    string linkTarget;
+    static void linkChild(Node* parent, Node* child) {
+        setParent(child, parent);
+        ++parent->dirInfo->childCount;
+        indexChild(parent, child);
+    }
 
-    Node(): name(""), isDirectory(false), content(""), firstChild(nullptr), nextSibling(nullptr), parent(nullptr),
-        createdAt(time(nullptr)), modifiedAt(time(nullptr)), fileSize(0), owner("root"), permissions(0755),
-        isSymLink(false), linkTarget("") {}
+    void unlinkChild(Node* parent, Node* child) {
+        ++namespaceGeneration;
+        ++retiredVersions;
+        unindexChild(parent, child);
+        --parent->dirInfo->childCount;
+    }
 
-    Node(string name, bool isDirectory, Node* parent = nullptr)
-        : name(name), isDirectory(isDirectory), content(""), firstChild(nullptr), nextSibling(nullptr), parent(parent),
-        createdAt(0), modifiedAt(0), fileSize(0), owner("root"), permissions(0755),
-        isSymLink(false), linkTarget("") {}
-};
+    uint32_t userId(const string& user) {
+        auto found = userIds.find(user);
+        if (found != userIds.end()) return found->second;
+        uint32_t id = (uint32_t)userIds.size();
+        userIds[user] = id;
+        return id;
+    }
 
-class FileSystem {
-private:
-    Node* root;
-    Node* currentDirectory;
+    // Owner bits for the owner, "other" bits for everyone else.
+    unsigned char accessFor(Node* node) {
+        if (node->maskUser != sessionUserId || node->maskGeneration != permGeneration) {
+            unsigned int bits = node->owner == sessionUser ? node->permissions >> 6 : node->permissions;
+            node->accessMask = (unsigned char)(bits & 7);
+            node->maskUser = sessionUserId;
+            node->maskGeneration = permGeneration;
+        }
+        return node->accessMask;
+    }
 
-    vector<string> tokenize(const string& path) {
-        vector<string> tokens;
-        stringstream ss(path);
-        string token;
-        while (getline(ss, token, '/')) {
-            if (!token.empty()) tokens.push_back(token);
+    bool canAccess(Node* node, unsigned char want) {
+        return sessionUserId == 0 || (accessFor(node) & want) == want;
+    }
+
+    bool denyUnless(Node* node, unsigned char want) {
+        if (canAccess(node, want)) return false;
+        fail() << "Error: Permission denied" << endl;
+        return true;
+    }
+
+    // Masks and memoized symlink targets were computed under the old
+    // owners and modes.
+    void invalidateAccess() {
+        ++permGeneration;
+        ++namespaceGeneration;
+    }
+
+    bool reportLookupError() {
+        if (lastLookupError == LookupError::SymlinkLoop) {
+            fail() << "Error: Too many levels of symbolic links" << endl;
+            return true;
         }
-        return tokens;
+        if (lastLookupError == LookupError::PermissionDenied) {
+            fail() << "Error: Permission denied" << endl;
+            return true;
+        }
+        return false;
     }
 
-    
+    // Whether an entry of (live) directory `dir` is covered by `watch`.
+    static bool watchCoversChildOf(const Watch& watch, Node* dir) {
+        for (; dir; dir = parentOf(dir)) {
+            if (dir->inode == watch.inode) return true;
+            if (!watch.recursive) return false;
+        }
+        return false;
+    }
+
+    static bool watchCovers(const Watch& watch, Node* node) {
+        return node->inode == watch.inode || watchCoversChildOf(watch, parentOf(node));
+    }
+
+    void publish(int id, const FsEvent& event) {
+        if (txn) {
+            txn->events.push_back({ id, event });
+            return;
+        }
+        auto found = watches.find(id);
+        if (found != watches.end()) found->second->ring.push(event);
+    }
+
+    // Keeps watch paths current when `event` moves or deletes a watched
+    // node or one of its ancestors.
+    void retrackWatches(const FsEvent& event) {
+        const string& gone = event.kind == FsEvent::Move ? event.from : event.path;
+        for (auto& entry : watches) {
+            Watch& watch = *entry.second;
+            if (watch.removed || watch.path.compare(0, gone.size(), gone) != 0) continue;
+            if (watch.path.size() > gone.size() && watch.path[gone.size()] != '/') continue;
+            if (event.kind == FsEvent::Move) watch.path = event.path + watch.path.substr(gone.size());
+            else watch.removed = true;
+        }
+    }
+
+    // Paths are only built when someone is watching, so an unwatched file
+    // system pays a single empty() check per mutation. `fromParent` is the
+    // directory a moved node left, whose watches see the move as well.
+    void notify(FsEvent::Kind kind, Node* node, const string& from = "", Node* fromParent = nullptr) {
+        if (watches.empty()) return;
+        FsEvent event = { kind, constructPath(node), from, node->isDirectory };
+        for (auto& entry : watches) {
+            Watch& watch = *entry.second;
+            if (watch.removed) continue;
+            if (watchCovers(watch, node) || (fromParent && watchCoversChildOf(watch, fromParent))) {
+                publish(entry.first, event);
+            }
+        }
+        if (kind == FsEvent::Move || kind == FsEvent::Delete) retrackWatches(event);
+    }
 
+    string pathForMove(Node* node) {
+        return watches.empty() ? "" : constructPath(node);
+    }
+
+    // Frees what the transaction created and makes its frozen root live
+    // again. The old nodes were never modified, only their live-only links
+    // moved: `forward` was set and the anchor handed over wherever a node
+    // got copied, and copying a node means its ancestors were copied too,
+    // so both walks stop at the first untouched node.
+    void rollbackTransaction() {
+        Transaction& open = *txn;
+        vector<Node*> created;
+        walkTree(root, [&](Node* node) {
+            if (node->epoch < open.epoch) return Visit::SkipChildren;
+            created.push_back(node);
+            return Visit::Continue;
+        });
+        for (Node* node : created) destroyNode(node);
+
+        walkTree(open.root, [](Node* node) {
+            if (!node->forward) return Visit::SkipChildren;
+            node->forward = nullptr;
+            if (node->isDirectory) node->dirInfo->anchor->live = node;
+            return Visit::Continue;
+        });
+
+        root = open.root;
+        currentDirectory = open.currentDirectory;
+        cwdSnapshot = open.cwdSnapshot;
+        snapshotPath = open.snapshotPath;
+        ownerUsage = move(open.ownerUsage);
+        ownerQuotas = move(open.ownerQuotas);
+        quotaDirs = move(open.quotaDirs);
+        for (const auto& saved : open.watchPaths) {
+            auto found = watches.find(saved.first);
+            if (found == watches.end()) continue;
+            found->second->path = saved.second.first;
+            found->second->removed = saved.second.second;
+        }
+        pendingRollups.clear();
+        deferRollups = open.deferredRollups;
+        frozenBelow = open.snapshotFrozenBelow;
+        ++namespaceGeneration;
+        ++permGeneration;
+        txn.reset();
+    }
+
+    bool rejectReadOnly() {
+        if (!lastLookupReadOnly) return false;
+        fail() << "Error: Snapshots are read-only" << endl;
+        return true;
+    }
+
+    void destroyNode(Node* node) {
+        forgetInflated(node);
+        releaseChunks(node);
+        releaseExtent(node);
+        untrack(node);
+        releaseAnchor(node->parent);
+        if (node->isDirectory) {
+            ChildIndex::release(node->dirInfo->children);
+            if (node->dirInfo->anchor->live == node) node->dirInfo->anchor->live = nullptr;
+            releaseAnchor(node->dirInfo->anchor);
+        }
+        delete node;
+    }
+
+    void dropAccounting(Node* node) {
+        chargeOwner(node->owner, node->isDirectory ? 0 : -(long long)node->fileSize, -1);
+        if (node->isDirectory) {
+            pendingRollups.erase(node);
+            quotaDirs.erase(node);
+        }
+    }
+
+    // Drops a node's accounting and frees it unless a snapshot still holds
+    // it. Children are not touched.
+    void releaseNode(Node* node) {
+        dropAccounting(node);
+        if (!isFrozen(node)) destroyNode(node);
+        else if (txn && node->epoch >= txn->snapshotFrozenBelow) txn->retired.push_back(node);
+    }
 
+    // Frees every node below `dir`, leaving `dir` itself in place. The
+    // walk finishes first: freeing a directory changes an index, after
+    // which the cursor finds its place again by name, reading the siblings
+    // it already visited.
     void deleteTree(Node* dir) {
-        Node* child = dir->firstChild;
-        while (child) {
-            Node* next = child->nextSibling;
-            if (child->isDirectory) {
-                deleteTree(child);  
+        vector<Node*> below;
+        walkTree(dir, [&below, dir](Node* node) {
+            if (node != dir) below.push_back(node);
+            return Visit::Continue;
+        });
+        for (Node* node : below) releaseNode(node);
+        if (!isFrozen(dir)) {
+            ChildIndex::release(dir->dirInfo->children);
+            dir->dirInfo->children = nullptr;
+            dir->dirInfo->childCount = 0;
+        }
+    }
+
+    // Adds every node reachable from `start` to `seen`, skipping subtrees
+    // that are already there.
+    static void markReachable(Node* start, unordered_set<Node*>& seen) {
+        walkTree(start, [&seen](Node* node) {
+            return seen.insert(node).second ? Visit::Continue : Visit::SkipChildren;
+        });
+    }
+
+    // Every node still in use: the live tree, the snapshots, the tree an
+    // open transaction would roll back to, and the trees jobs hold.
+    void markAllReachable(unordered_set<Node*>& seen) {
+        markReachable(root, seen);
+        for (const auto& entry : snapshots) markReachable(entry.second.root, seen);
+        if (txn) markReachable(txn->root, seen);
+        for (const auto& entry : jobs) {
+            for (Node* node : { entry.second->view, entry.second->start, entry.second->held }) {
+                if (node) markReachable(node, seen);
             }
-            delete child;  
-            child = next;
+            for (Node* node : entry.second->kept) markReachable(node, seen);
+        }
+    }
+
+    // Frees the nodes under `starts` that nothing in use reaches any more.
+    size_t freeOrphans(initializer_list<Node*> starts) {
+        unordered_set<Node*> reachable;
+        markAllReachable(reachable);
+        vector<Node*> orphans;
+        for (Node* start : starts) {
+            walkTree(start, [&](Node* node) {
+                if (!reachable.insert(node).second) return Visit::SkipChildren;
+                orphans.push_back(node);
+                return Visit::Continue;
+            });
         }
+        for (Node* node : orphans) destroyNode(node);
+        return orphans.size();
+    }
+
+    // The oldest epoch still shared: the newest snapshot or job pin.
+    void updateFrozenBelow() {
+        frozenBelow = 0;
+        for (const auto& entry : snapshots) frozenBelow = max(frozenBelow, entry.second.epoch);
+        for (const auto& entry : jobs) {
+            if (entry.second->view) frozenBelow = max(frozenBelow, entry.second->viewEpoch);
+        }
+    }
+
+    // Detached copy of one node: same metadata and (shared) content, no
+    // children, no directory quota, and not yet charged to its owner.
+    Node* copyOne(Node* node) {
+        Node* copy = new Node(*node);
+        copy->epoch = liveEpoch;
+        copy->inode = nextInode++;
+        copy->forward = nullptr;
+        copy->parent = nullptr;
+        if (copy->linkInfo) copy->linkInfo->resolvedTarget = nullptr;
+        if (copy->dirInfo) {
+            copy->dirInfo->children = nullptr;
+            copy->dirInfo->childCount = 0;
+            copy->dirInfo->anchor = new DirAnchor{ copy, 1 };
+            copy->dirInfo->quotaBytes = copy->dirInfo->quotaInodes = 0;
+        }
+        if (copy->chunks) {
+            for (uint64_t key : *copy->chunks) blockStore.addRef(key);
+        }
+        if (copy->isPacked) extents.addRef(copy->extent);
+        adoptPaging(copy);
+        return copy;
+    }
+
+    // Copies carry the source rollups, so only the top copy needs to be
+    // propagated; callers flush pending rollups before copying.
+    Node* copyNode(Node* source, Node* destParent, const string& destName) {
+        // copies[i] is the copy of the directory at depth i of the walk.
+        vector<Node*> copies;
+        Node* top = nullptr;
+        walkTree(source,
+            [&](Node* node) {
+                Node* parent = copies.empty() ? destParent : copies.back();
+                Node* copy = copyOne(node);
+                if (node == source) {
+                    copy->name = destName;
+                    top = copy;
+                }
+                chargeOwner(copy->owner, copy->isDirectory ? 0 : copy->fileSize, 1);
+                linkChild(parent, copy);
+                if (node->isDirectory) copies.push_back(copy);
+                return Visit::Continue;
+            },
+            [&](Node* node) {
+                if (node->isDirectory) copies.pop_back();
+            });
+        return top;
+    }
+
+    // Frees a tree a job built off to the side and never attached.
+    void discardTree(Node* top) {
+        vector<Node*> nodes;
+        walkTree(top, [&nodes](Node* node) {
+            nodes.push_back(node);
+            return Visit::Continue;
+        });
+        for (Node* node : nodes) destroyNode(node);
+    }
+
+    static size_t entriesUnder(const UsageDelta& usage) {
+        return (size_t)(usage.files + usage.dirs);
+    }
+
+    bool refuseJob() {
+        if (!txn) return false;
+        fail() << "Error: Background jobs cannot start inside a transaction" << endl;
+        return true;
+    }
+
+    Job& newJob(const string& description, bool cancellable, ProgressFn onProgress) {
+        unique_ptr<Job>& job = jobs[nextJobId];
+        job.reset(new Job());
+        job->id = nextJobId++;
+        job->description = description;
+        job->user = sessionUser;
+        job->userId = sessionUserId;
+        job->cancellable = cancellable;
+        job->cancelRequested = false;
+        job->done = job->total = 0;
+        job->onProgress = move(onProgress);
+        job->view = job->start = job->held = nullptr;
+        job->viewEpoch = job->changesAtPin = 0;
+        return *job;
+    }
+
+    void launch(Job& job, Task task) {
+        job.task = move(task);
+        jobOut(job) << "started: " << job.description << endl;
+        schedule(job, job.task.start());
+    }
+
+    ostream& jobOut(const Job& job) {
+        return cout << "[job " << job.id << "] ";
+    }
+
+    ostream& jobFail(const Job& job) {
+        return fail() << "Error: job " << job.id << ": ";
     }
 
-    void copyNode(Node* source, Node* destParent, const string& destName) {
-        Node* copy = new Node(*source);
-        copy->name = destName;
+    // Freezes the live tree the way createSnapshot does, so the job reads
+    // it from `start` on as it was at this point.
+    void pinView(Job& job, Node* start) {
+        flushRollups();
+        ++liveEpoch;
+        frozenBelow = liveEpoch;
+        job.view = root;
+        job.start = start;
+        job.viewEpoch = liveEpoch;
+        job.changesAtPin = retiredVersions + holderReleases;
+    }
+
+    void releaseView(Job& job) {
+        Node* view = job.view;
+        Node* start = job.start;
+        job.view = job.start = nullptr;
+        if (retiredVersions + holderReleases != job.changesAtPin) freeOrphans({ view, start });
+        ++holderReleases;
+        updateFrozenBelow();
+    }
+
+    bool shouldYield(const Job& job) {
+        return foregroundWaiting.load() > 0 || executor.hasPending() ||
+            chrono::steady_clock::now() - job.sliceStart > sliceBudget;
+    }
+
+    void schedule(Job& job, coroutine_handle<> next) {
+        executor.post([this, &job, next] { runSlice(job, next); });
+    }
+
+    // Runs on the executor thread. Waiting foreground commands go first:
+    // the executor sleeps with the lock released until none is left. The
+    // job runs as the user who started it, so the two sessions are swapped
+    // for the slice. Symlink targets memoized under one user were checked
+    // with that user's permissions, so a swap between different users
+    // drops them the way su does.
+    void runSlice(Job& job, coroutine_handle<> next) {
+        unique_lock<mutex> hold(stateLock);
+        foregroundDone.wait(hold, [this] { return foregroundWaiting.load() == 0; });
+        bool otherUser = job.userId != sessionUserId;
+        swap(sessionUser, job.user);
+        swap(sessionUserId, job.userId);
+        if (otherUser) ++namespaceGeneration;
+        job.sliceStart = chrono::steady_clock::now();
+        next.resume();
+        swap(sessionUser, job.user);
+        swap(sessionUserId, job.userId);
+        if (otherUser) ++namespaceGeneration;
+        if (job.task.done()) finishJob(job);
+    }
+
+    void finishJob(Job& job) {
+        jobOut(job) << (job.cancelRequested ? "cancelled" : "done") << endl;
+        if (job.view) releaseView(job);
+        jobs.erase(job.id);
+        jobsChanged.notify_all();
+    }
+
+    Checkpoint checkpoint(Job& job, size_t done) {
+        job.done = done;
+        if (job.onProgress) job.onProgress(job.done, job.total);
+        return { *this, job };
+    }
 
-        if (source->isDirectory) {
-            copy->firstChild = nullptr;
-            Node* child = source->firstChild;
-            while (child) {
-                copyNode(child, copy, child->name);
-                child = child->nextSibling;
+    // walkTree for jobs: a checkpoint after each directory and every
+    // entriesPerCheckpoint entries. Stops early on Visit::Stop or once the
+    // job is cancelled.
+    Task walkAsync(Job& job, Node* start, function<Visit(Node*)> pre, function<void(Node*)> post) {
+        TreeCursor cursor(start);
+        Node* node;
+        TreeCursor::Phase phase;
+        size_t visited = 0;
+        size_t sinceCheckpoint = 0;
+        while (cursor.next(node, phase)) {
+            bool boundary = ++sinceCheckpoint >= entriesPerCheckpoint;
+            if (phase == TreeCursor::PreOrder) {
+                ++visited;
+                Visit action = pre(node);
+                if (action == Visit::Stop) co_return;
+                if (action == Visit::SkipChildren) cursor.skipChildren();
+            }
+            else {
+                boundary = boundary || node->isDirectory;
+                post(node);
+            }
+            if (boundary) {
+                sinceCheckpoint = 0;
+                if (!co_await checkpoint(job, visited)) co_return;
             }
         }
-        else {
-            copy->content = source->content;
-            copy->fileSize = source->fileSize;
+    }
+
+    Task saveJob(Job& job, ofstream out, string filename) {
+        co_await walkAsync(job, job.start,
+            [&](Node* node) {
+                if (!node->isDirectory) {
+                    writeContent(node, out);
+                    out << "\n";
+                }
+                return Visit::Continue;
+            },
+            [](Node*) {});
+        out.close();
+        if (job.cancelRequested) {
+            error_code ec;
+            filesystem::remove(filename, ec);
+            co_return;
+        }
+        jobOut(job) << "File system content saved to " << filename << endl;
+    }
+
+    // Reads the host file a chunk per checkpoint; the target is looked up
+    // again by path once the content is in.
+    Task loadJob(Job& job, ifstream in, string filename, string targetPath) {
+        static constexpr size_t chunkSize = 1 << 20;
+        string content(job.total, '\0');
+        size_t loaded = 0;
+        while (loaded < content.size()) {
+            size_t chunk = min(chunkSize, content.size() - loaded);
+            if (in.read(&content[loaded], chunk).gcount() != (streamsize)chunk) break;
+            loaded += chunk;
+            if (!co_await checkpoint(job, loaded)) co_return;
+        }
+        if (loaded < content.size()) {
+            jobFail(job) << "Unable to read " << filename << endl;
+            co_return;
+        }
+
+        Node* target = findNode(targetPath);
+        if (reportLookupError()) co_return;
+        if (!target || isReadOnlyLookup()) {
+            jobFail(job) << "Node at path '" << targetPath << "' not found." << endl;
+            co_return;
+        }
+        size_t failuresBefore = failures;
+        deserializeNode(content, target);
+        if (failures == failuresBefore) {
+            jobOut(job) << "File content successfully loaded into node: " << targetPath << endl;
+        }
+    }
+
+    Task grepJob(Job& job, string content) {
+        vector<string> results;
+        co_await walkAsync(job, job.start,
+            [&](Node* node) {
+                if (node->isDirectory) {
+                    return canAccess(node, AccessRead | AccessExecute) ? Visit::Continue : Visit::SkipChildren;
+                }
+                if (canAccess(node, AccessRead) && readContent(node).find(content) != string::npos) {
+                    results.push_back(node->name);
+                }
+                return Visit::Continue;
+            },
+            [](Node*) {});
+        if (job.cancelRequested) co_return;
+        if (results.empty()) {
+            jobOut(job) << "No files contain the specified content.\n";
+        }
+        for (const string& name : results) {
+            jobOut(job) << "File: " << name << " contains the specified content.\n";
+        }
+    }
+
+    // Re-checks a finished background copy against the tree as it is now.
+    bool copyFits(const Job& job, Node* destParent, const string& destName, Node* top,
+        const unordered_map<string, UsageDelta>& perOwner) {
+        if (reportLookupError()) return false;
+        if (!destParent || !destParent->isDirectory || isReadOnlyLookup()) {
+            jobFail(job) << "Destination path is invalid" << endl;
+            return false;
+        }
+        if (findChild(destParent, destName)) {
+            jobFail(job) << "A file or directory with the same name already exists at the destination" << endl;
+            return false;
+        }
+        if (denyUnless(destParent, AccessWrite | AccessExecute)) return false;
+        for (const auto& entry : perOwner) {
+            if (!checkQuota(nullptr, entry.first, entry.second)) return false;
+        }
+        return checkQuota(destParent, "", usageOf(top));
+    }
+
+    // Builds the copy detached from the tree, then attaches it in one step
+    // if the destination is still there and the quotas still allow it.
+    Task copyJob(Job& job, string destDirPath, string destName, string label) {
+        // copies[i] is the copy of the directory at depth i of the walk.
+        vector<Node*> copies;
+        unordered_map<string, UsageDelta> perOwner;
+        unsigned long startEpoch = liveEpoch;
+        bool readable = true;
+        co_await walkAsync(job, job.start,
+            [&](Node* node) {
+                unsigned char want = node->isDirectory ? AccessRead | AccessExecute : AccessRead;
+                if (!canAccess(node, want)) {
+                    readable = false;
+                    return Visit::Stop;
+                }
+                Node* copy = copyOne(node);
+                if (copies.empty()) {
+                    copy->name = destName;
+                    job.held = copy;
+                }
+                else {
+                    linkChild(copies.back(), copy);
+                }
+                UsageDelta& need = perOwner[copy->owner];
+                if (copy->isDirectory) {
+                    ++need.dirs;
+                    copies.push_back(copy);
+                }
+                else {
+                    need.bytes += copy->fileSize;
+                    ++need.files;
+                }
+                return Visit::Continue;
+            },
+            [&](Node* node) {
+                if (node->isDirectory) copies.pop_back();
+            });
+
+        Node* top = job.held;
+        job.held = nullptr;
+        if (!readable) jobFail(job) << "Permission denied" << endl;
+        if (job.cancelRequested || !readable) {
+            if (top) discardTree(top);
+            co_return;
+        }
+
+        Node* destParent = findNode(destDirPath);
+        if (!copyFits(job, destParent, destName, top, perOwner)) {
+            discardTree(top);
+            co_return;
+        }
+
+        // A snapshot or pin taken meanwhile made the early copies look
+        // frozen, but nothing else can reach them.
+        if (liveEpoch != startEpoch) {
+            walkTree(top, [this](Node* node) {
+                node->epoch = liveEpoch;
+                return Visit::Continue;
+            });
+        }
+        destParent = makeMutable(destParent);
+        for (const auto& entry : perOwner) {
+            chargeOwner(entry.first, entry.second.bytes, entry.second.files + entry.second.dirs);
         }
+        linkChild(destParent, top);
+        applyUsage(destParent, usageOf(top));
+        notify(FsEvent::Create, top);
+        jobOut(job) << "Successfully copied " << label << endl;
+    }
 
-        copy->nextSibling = destParent->firstChild;
-        destParent->firstChild = copy;
-        copy->parent = destParent;
+    // The target is already unlinked; this frees it bottom-up. Nodes that
+    // were frozen when it was unlinked are left to their snapshot or pin,
+    // unless that went away in the meantime. They stay in job.kept until
+    // then, since freeing their live parent cuts them off from `held`.
+    Task rmdirJob(Job& job, Node* target, unsigned long sharedBelow, unsigned long releasesBefore) {
+        vector<Node*>& kept = job.kept;
+        co_await walkAsync(job, target,
+            [](Node*) { return Visit::Continue; },
+            [&](Node* node) {
+                if (node == target) return;
+                dropAccounting(node);
+                if (node->epoch < sharedBelow) {
+                    kept.push_back(node);
+                    return;
+                }
+                // A live node's parent is live too and still lists it.
+                Node* parent = parentOf(node);
+                ChildIndex::erase(parent->dirInfo->children, node->name);
+                --parent->dirInfo->childCount;
+                destroyNode(node);
+            });
+
+        job.held = nullptr;
+        dropAccounting(target);
+        if (target->epoch < sharedBelow) kept.push_back(target);
+        else destroyNode(target);
+
+        if (holderReleases != releasesBefore && !kept.empty()) {
+            vector<Node*> orphans;
+            orphans.swap(kept);
+            unordered_set<Node*> reachable;
+            markAllReachable(reachable);
+            for (Node* node : orphans) {
+                if (!reachable.count(node)) destroyNode(node);
+            }
+        }
+        kept.clear();
+        jobOut(job) << "Directory removed successfully." << endl;
     }
 
     bool isCircularReference(Node* source, Node* destination) {
         while (destination) {
             if (destination == source) return true;
-            destination = destination->parent;
+            destination = parentOf(destination);
         }
         return false;
     }
 
     void serializeNode(Node* node, ofstream& out) {
-        if (!node) return;
+        walkTree(node, [this, &out](Node* current) {
+            if (!current->isDirectory) {
+                writeContent(current, out);
+                out << "\n";
+            }
+            return Visit::Continue;
+        });
+    }
 
-        if (!node->isDirectory) {
-            out << node->content << "\n";
+
+    // One sized read for the whole file; the bytes are kept exactly,
+    // including a missing trailing newline.
+    static bool readHostFile(const string& path, string& out) {
+        ifstream in(path, ios::binary);
+        if (!in) return false;
+        in.seekg(0, ios::end);
+        streamoff size = in.tellg();
+        if (size < 0) return false;
+        out.resize((size_t)size);
+        in.seekg(0, ios::beg);
+        return size == 0 || in.read(&out[0], size).gcount() == size;
+    }
+
+    // C++17 has no clock_cast. The file clock and the system clock differ
+    // by a whole number of seconds on the standard libraries we build
+    // with, so measure that offset once and round away sampling jitter.
+    static chrono::seconds fileClockOffset() {
+        using namespace chrono;
+        static const seconds offset = round<seconds>(
+            filesystem::file_time_type::clock::now().time_since_epoch() -
+            duration_cast<filesystem::file_time_type::duration>(system_clock::now().time_since_epoch()));
+        return offset;
+    }
+
+    static time_t hostTime(filesystem::file_time_type stamp) {
+        using namespace chrono;
+        return (time_t)floor<seconds>(stamp.time_since_epoch() - fileClockOffset()).count();
+    }
+
+    static filesystem::file_time_type toHostTime(time_t stamp) {
+        using namespace chrono;
+        return filesystem::file_time_type(
+            duration_cast<filesystem::file_time_type::duration>(seconds(stamp) + fileClockOffset()));
+    }
+
+    // Zero-padded octal with a trailing NUL. A value that needs more digits
+    // than the field holds (a size of 8 GiB or more in the 12-byte field)
+    // uses the GNU base-256 form instead: the high bit of the first byte is
+    // set and the rest holds the value big-endian.
+    static void tarNumber(char* field, size_t width, unsigned long long value) {
+        size_t digits = width - 1;
+        if (value >> (3 * digits) == 0) {
+            field[digits] = '\0';
+            for (size_t i = digits; i-- > 0; value >>= 3) field[i] = (char)('0' + (value & 7));
+            return;
         }
+        memset(field, 0, width);
+        field[0] = (char)0x80;
+        for (size_t i = width - 1; i > 0 && value; --i, value >>= 8) field[i] = (char)(value & 0xff);
+    }
 
-        if (node->isDirectory) {
-            Node* child = node->firstChild;
-            while (child) {
-                serializeNode(child, out);
-                child = child->nextSibling;
+    // Fills a 512-byte ustar header. Paths over 100 bytes are split at a
+    // '/' into prefix and name; returns false if no split fits.
+    static bool tarHeader(char* block, const string& path, Node* node, char type, size_t size) {
+        memset(block, 0, 512);
+        size_t cut = string::npos;
+        if (path.size() > 100) {
+            cut = path.find('/', path.size() - 101);
+            if (cut == string::npos || cut > 155 || cut + 1 >= path.size()) return false;
+            memcpy(block + 345, path.data(), cut);
+        }
+        size_t nameStart = cut == string::npos ? 0 : cut + 1;
+        memcpy(block, path.data() + nameStart, path.size() - nameStart);
+        if (type == '2') {
+            if (node->linkInfo->target.size() > 100) return false;
+            memcpy(block + 157, node->linkInfo->target.data(), node->linkInfo->target.size());
+        }
+
+        tarNumber(block + 100, 8, node->permissions & 07777);
+        tarNumber(block + 108, 8, 0);
+        tarNumber(block + 116, 8, 0);
+        tarNumber(block + 124, 12, size);
+        tarNumber(block + 136, 12, (unsigned long long)max<time_t>(node->modifiedAt, 0));
+        block[156] = type;
+        memcpy(block + 257, "ustar", 6);
+        memcpy(block + 263, "00", 2);
+        memcpy(block + 265, node->owner.data(), min<size_t>(node->owner.size(), 31));
+
+        memset(block + 148, ' ', 8);
+        unsigned int sum = 0;
+        for (int i = 0; i < 512; ++i) sum += (unsigned char)block[i];
+        snprintf(block + 148, 8, "%06o", sum);
+        block[155] = ' ';
+        return true;
+    }
+
+    struct ExportEntry {
+        Node* node;
+        string path;
+    };
+
+    // Whether `name` can be written out as a single host path component.
+    // rename accepts names with slashes, and ".." would climb out.
+    static bool isPortableName(const string& name) {
+        return !name.empty() && name != "." && name != ".." &&
+            name.find('/') == string::npos && name.find('\0') == string::npos;
+    }
+
+    // Pre-order list of everything under `source` the session user may
+    // read, with paths relative to it. Unreadable entries, and entries
+    // whose names cannot be written to the host, are counted and skipped
+    // along with everything below them.
+    void collectExport(Node* source, vector<ExportEntry>& entries, size_t& skipped) {
+        TreeCursor cursor(source);
+        Node* node;
+        TreeCursor::Phase phase;
+        string path;
+        vector<size_t> marks;
+        while (cursor.next(node, phase)) {
+            if (node == source) continue;
+            if (phase == TreeCursor::PostOrder) {
+                path.resize(marks.back());
+                marks.pop_back();
+                continue;
+            }
+            marks.push_back(path.size());
+            if (!path.empty()) path += '/';
+            path += node->name;
+
+            unsigned char want = node->isDirectory ? AccessRead | AccessExecute : AccessRead;
+            if (!isPortableName(node->name) || (!node->isSymLink && !canAccess(node, want))) {
+                ++skipped;
+                cursor.skipChildren();
+                continue;
             }
+            entries.push_back({ node, path });
         }
     }
 
+    // Headers and content go straight into one large-buffered stream;
+    // chunked files are written block by block without being reassembled.
+    bool exportTar(const vector<ExportEntry>& entries, const string& target, size_t& skipped) {
+        vector<char> buffer(1 << 20);
+        ofstream out;
+        out.rdbuf()->pubsetbuf(buffer.data(), buffer.size());
+        out.open(target, ios::binary | ios::trunc);
+        if (!out) {
+            fail() << "Error: Unable to open archive for writing: " << target << endl;
+            return false;
+        }
 
-    void deserializeNode(ifstream& in, Node* targetNode) {
-        if (!targetNode || targetNode->isDirectory) {
-            cout << "Error: Target node is invalid or a directory." << endl;
-            return;
+        static const char zeros[1024] = {};
+        char block[512];
+        for (const ExportEntry& entry : entries) {
+            Node* node = entry.node;
+            char type = node->isDirectory ? '5' : node->isSymLink ? '2' : '0';
+            size_t size = type == '0' ? node->fileSize : 0;
+            if (!tarHeader(block, type == '5' ? entry.path + "/" : entry.path, node, type, size)) {
+                ++skipped;
+                continue;
+            }
+            out.write(block, 512);
+            if (type != '0') continue;
+            writeContent(node, out);
+            if (size % 512) out.write(zeros, 512 - size % 512);
+        }
+        out.write(zeros, sizeof(zeros));
+        out.close();
+        if (!out) {
+            fail() << "Error: Writing the archive failed" << endl;
+            return false;
         }
+        return true;
+    }
 
-        string content;
-        string line;
+    // Directories and links are made on this thread. File bodies are
+    // written by up to `threads` workers a batch at a time: plain content
+    // is handed over by reference, compressed or chunked content is
+    // inflated once into the batch. Directory modes and mtimes are set
+    // last, deepest first, so a read-only directory can still be filled.
+    bool exportDirectory(const vector<ExportEntry>& entries, const string& target, unsigned threads, size_t& skipped) {
+        error_code ec;
+        filesystem::path base(target);
+        filesystem::create_directories(base, ec);
+        if (ec || !filesystem::is_directory(base, ec)) {
+            fail() << "Error: Unable to create host directory: " << target << endl;
+            return false;
+        }
+
+        ofstream owners(base / ".owners");
+        vector<size_t> files;
+        for (size_t i = 0; i < entries.size(); ++i) {
+            Node* node = entries[i].node;
+            // collectExport already refused such names; nothing is written
+            // outside `base` even if one slips through.
+            filesystem::path relative = filesystem::path(entries[i].path).lexically_normal();
+            if (relative.empty() || !relative.is_relative() || *relative.begin() == "..") {
+                ++skipped;
+                continue;
+            }
+            filesystem::path hostPath = base / relative;
+            owners << node->owner << "\t" << oct << node->permissions << dec << "\t" << entries[i].path << "\n";
+            if (node->isDirectory) {
+                filesystem::create_directory(hostPath, ec);
+            }
+            else if (node->isSymLink) {
+                filesystem::create_symlink(node->linkInfo->target, hostPath, ec);
+            }
+            else {
+                files.push_back(i);
+                continue;
+            }
+            if (ec) {
+                ++skipped;
+                ec.clear();
+            }
+        }
+
+        struct Job {
+            const string* data;
+            string inflated;
+            bool ok;
+        };
+        static constexpr size_t batchBytes = 64 << 20;
+        vector<Job> jobs;
+        for (size_t first = 0; first < files.size();) {
+            size_t last = first, bytes = 0;
+            while (last < files.size() && (last == first || bytes < batchBytes)) {
+                bytes += entries[files[last++]].node->fileSize;
+            }
+
+            jobs.assign(last - first, Job());
+            for (size_t i = first; i < last; ++i) {
+                Node* node = entries[files[i]].node;
+                Job& job = jobs[i - first];
+                node->accessedAt = time(nullptr);
+                if (node->isCompressed || node->isChunked || node->isPacked) {
+                    inflateContent(node, job.inflated);
+                    job.data = &job.inflated;
+                }
+                else {
+                    // Not paged in, so preparing the batch never evicts
+                    // content an earlier job still points at.
+                    job.data = physicalContent(node, job.inflated);
+                }
+            }
+
+            atomic<size_t> cursor(first);
+            auto writer = [&]() {
+                for (size_t i; (i = cursor.fetch_add(1)) < last;) {
+                    const ExportEntry& entry = entries[files[i]];
+                    Job& job = jobs[i - first];
+                    if (!job.data) continue;
+                    filesystem::path hostPath = base / entry.path;
+                    ofstream out(hostPath, ios::binary | ios::trunc);
+                    out.write(job.data->data(), job.data->size());
+                    out.close();
+                    job.ok = (bool)out;
+                    error_code local;
+                    filesystem::last_write_time(hostPath, toHostTime(entry.node->modifiedAt), local);
+                    filesystem::permissions(hostPath, filesystem::perms(entry.node->permissions & 07777), local);
+                }
+            };
+            vector<thread> pool;
+            for (unsigned w = 1; w < threads && w < last - first; ++w) pool.emplace_back(writer);
+            writer();
+            for (thread& worker : pool) worker.join();
+
+            for (const Job& job : jobs) {
+                if (!job.ok) ++skipped;
+            }
+            first = last;
+        }
+
+        for (size_t i = entries.size(); i-- > 0;) {
+            Node* node = entries[i].node;
+            if (!node->isDirectory) continue;
+            filesystem::path hostPath = base / entries[i].path;
+            filesystem::last_write_time(hostPath, toHostTime(node->modifiedAt), ec);
+            filesystem::permissions(hostPath, filesystem::perms(node->permissions & 07777), ec);
+        }
+        return true;
+    }
 
-        while (getline(in, line)) {
-            content += line + "\n";
+    void deserializeNode(const string& content, Node* targetNode) {
+        if (!targetNode || targetNode->isDirectory) {
+            fail() << "Error: Target node is invalid or a directory." << endl;
+            return;
         }
 
         if (content.empty()) {
-            cout << "Error: The file is empty or could not be read." << endl;
+            fail() << "Error: The file is empty or could not be read." << endl;
             return;
         }
 
-        targetNode->content = content;
-        targetNode->fileSize = content.size();  
+        if (denyUnless(targetNode, AccessWrite)) return;
+        UsageDelta delta = { (long long)content.size() - (long long)targetNode->fileSize, 0, 0 };
+        if (!checkQuota(parentOf(targetNode), targetNode->owner, delta)) return;
+        targetNode = makeMutable(targetNode);
+        chargeOwner(targetNode->owner, delta.bytes, 0);
+        applyUsage(parentOf(targetNode), delta);
+        storeContent(targetNode, content);
+        targetNode->modifiedAt = time(nullptr);
+        notify(FsEvent::Modify, targetNode);
     }
 
 
@@ -139,58 +2929,174 @@ private:
 
 public:
     FileSystem() {
-        root = new Node("/", true);
+        liveEpoch = 1;
+        frozenBelow = 0;
+        lastLookupReadOnly = false;
+        lastLookupError = LookupError::None;
+        namespaceGeneration = 0;
+        sessionUser = "root";
+        sessionUserId = userId(sessionUser);
+        permGeneration = 1;
+        nextWatchId = 1;
+        nextInode = 1;
+        root = newNode("/", true, nullptr);
         currentDirectory = root;
+        deferRollups = false;
+        compressThreshold = 4096;
+        dedupEnabled = false;
+        packLimit = 256;
+        packingEnabled = true;
+        failures = 0;
+        memoryCeiling = 0;
+        residentBytes = residentFiles = spilledFiles = 0;
+        lruHead = lruTail = nullptr;
+        pageHits = pageFaults = evictions = 0;
+        nextJobId = 1;
+        foregroundWaiting = 0;
+        retiredVersions = holderReleases = 0;
+        chargeOwner(root->owner, 0, 1);
     }
 
+    // Cancels what can be cancelled and lets the rest finish first.
     ~FileSystem() {
-        deleteTree(root);
+        {
+            unique_lock<mutex> hold(stateLock);
+            for (const auto& entry : jobs) {
+                if (entry.second->cancellable) entry.second->cancelRequested = true;
+            }
+            jobsChanged.wait(hold, [this] { return jobs.empty(); });
+        }
+        executor.stop();
+        unordered_set<Node*> nodes;
+        markAllReachable(nodes);
+        for (Node* node : nodes) destroyNode(node);
+    }
+
+    bool exceedsMaxPathLength(const string& path) {
+        return path.length() > 255;
+    }
+
+    // Walks `path` from `at`. Symlinks are followed mid-path, and at the
+    // leaf only when `followLeaf` is set.
+    bool resolvePath(PathState& at, const string& path, bool followLeaf, int& hops) {
+        if (!path.empty() && path[0] == '/') {
+            at.node = root;
+            at.snapshot.clear();
+            at.trail.clear();
+        }
+
+        vector<string> tokens = tokenize(path);
+        for (size_t i = 0; i < tokens.size(); ++i) {
+            const string& token = tokens[i];
+            if (token == ".snapshots" && at.node == root && at.snapshot.empty()) {
+                if (i + 1 == tokens.size()) return false;
+                auto found = snapshots.find(tokens[++i]);
+                if (found == snapshots.end()) return false;
+                at.snapshot = found->first;
+                at.node = found->second.root;
+                at.trail.assign(1, at.node);
+            }
+            else if (token == "..") {
+                if (!at.snapshot.empty()) {
+                    at.trail.pop_back();
+                    if (at.trail.empty()) {
+                        at.snapshot.clear();
+                        at.node = root;
+                    }
+                    else {
+                        at.node = at.trail.back();
+                    }
+                }
+                else if (at.node->parent) {
+                    at.node = parentOf(at.node);
+                }
+                else {
+                    return false;
+                }
+            }
+            else if (token == "." || token.empty()) {
+                continue;
+            }
+            else {
+                if (!canAccess(at.node, AccessExecute)) {
+                    lastLookupError = LookupError::PermissionDenied;
+                    return false;
+                }
+                Node* child = findChild(at.node, token);
+                if (!child) return false;
+
+                if (child->isSymLink && (followLeaf || i + 1 < tokens.size())) {
+                    if (!followLink(at, child, hops)) return false;
+                }
+                else {
+                    at.node = child;
+                    if (!at.snapshot.empty()) at.trail.push_back(child);
+                }
+            }
+        }
+        return true;
     }
 
-    bool exceedsMaxPathLength(const string& path) {
-        return path.length() > 255;
+    // Moves `at` from the directory holding `link` to the link's target.
+    // Targets reached from and within the live tree are memoized on the
+    // link until the namespace generation changes.
+    bool followLink(PathState& at, Node* link, int& hops) {
+        if (++hops > maxSymlinkHops) {
+            lastLookupError = LookupError::SymlinkLoop;
+            return false;
+        }
+
+        bool live = at.snapshot.empty();
+        if (live && link->linkInfo->resolvedTarget && link->linkInfo->resolvedGeneration == namespaceGeneration) {
+            at.node = link->linkInfo->resolvedTarget;
+            return true;
+        }
+
+        PathState target = at;
+        if (!resolvePath(target, link->linkInfo->target, true, hops)) return false;
+        if (live && target.snapshot.empty()) {
+            link->linkInfo->resolvedTarget = target.node;
+            link->linkInfo->resolvedGeneration = namespaceGeneration;
+        }
+        at = move(target);
+        return true;
     }
 
-    Node* findNode(const string& path) {
+    Node* findNode(const string& path, bool followLeaf = true) {
+        lastLookupReadOnly = false;
+        lastLookupError = LookupError::None;
+        lastLookupSnapshot.clear();
+        lastLookupPath.clear();
         if (path == "/") return root;
 
-        vector<string> tokens = tokenize(path);
+        PathState at;
+        if (!cwdSnapshot.empty()) {
+            at.node = snapshotPath.back();
+            at.snapshot = cwdSnapshot;
+            at.trail = snapshotPath;
+        }
+        else {
+            at.node = currentDirectory;
+        }
 
-        Node* node = (path[0] == '/') ? root : currentDirectory;
+        int hops = 0;
+        if (!resolvePath(at, path, followLeaf, hops)) return nullptr;
 
-        for (const string& token : tokens) {
-            if (token == "..") {
-                if (node->parent) {
-                    node = node->parent;
-                }
-                else {
-                    return nullptr;
-                }
-            }
-            else if (token == "." || token.empty()) {
-                continue;
-            }
-            else {
-                Node* child = node->firstChild;
-                bool found = false;
-                while (child) {
-                    if (child->name == token) {
-                        node = child;
-                        found = true;
-                        break;
-                    }
-                    child = child->nextSibling;
-                }
-                if (!found) return nullptr;
-            }
+        if (!at.snapshot.empty()) {
+            lastLookupReadOnly = true;
+            lastLookupSnapshot = at.snapshot;
+            lastLookupPath = move(at.trail);
         }
+        return at.node;
+    }
 
-        return node;
+    bool isReadOnlyLookup() const {
+        return lastLookupReadOnly;
     }
 
     void mkdir(const string& path) {
         if (exceedsMaxPathLength(path)) {
-            cout << "Error: Path length exceeds maximum allowed length of 255 characters" << endl;
+            fail() << "Error: Path length exceeds maximum allowed length of 255 characters" << endl;
             return;
         }
 
@@ -199,24 +3105,28 @@ public:
         string dirName = path.substr(lastSlash + 1);
 
         Node* parent = findNode(parentPath);
+        if (reportLookupError()) return;
         if (!parent || !parent->isDirectory) {
-            cout << "Error: Invalid path" << endl;
+            fail() << "Error: Invalid path" << endl;
             return;
         }
+        if (rejectReadOnly()) return;
+        if (denyUnless(parent, AccessWrite | AccessExecute)) return;
 
-        Node* child = parent->firstChild;
-        while (child) {
-            if (child->name == dirName && child->isDirectory) {
-                cout << "Error: Directory already exists" << endl;
-                return;
-            }
-            child = child->nextSibling;
+        if (Node* existing = findChild(parent, dirName)) {
+            fail() << (existing->isDirectory ? "Error: Directory already exists" : "Error: A file with the same name already exists") << endl;
+            return;
         }
 
-        Node* newDir = new Node(dirName, true, parent);
+        if (!checkQuota(parent, sessionUser, { 0, 0, 1 })) return;
 
-        newDir->nextSibling = parent->firstChild;
-        parent->firstChild = newDir;
+        parent = makeMutable(parent);
+        Node* newDir = newNode(dirName, true, parent);
+        newDir->owner = sessionUser;
+        chargeOwner(newDir->owner, 0, 1);
+        linkChild(parent, newDir);
+        applyUsage(parent, usageOf(newDir));
+        notify(FsEvent::Create, newDir);
 
         cout << "Directory '" << dirName << "' created successfully" << endl;
     }
@@ -229,76 +3139,147 @@ public:
 
     void cd(const string& path) {
         if (exceedsMaxPathLength(path)) {
-            cout << "Error: Path length exceeds maximum allowed length of 255 characters" << endl;
+            fail() << "Error: Path length exceeds maximum allowed length of 255 characters" << endl;
             return;
         }
 
-        Node* node = nullptr;
-        if (path[0] == '/') {
-            node = findNode(path);
-        }
-        else {
-            string fullPath = getFullPath(currentDirectory, path);  
-            node = findNode(fullPath);
-        }
-
+        Node* node = findNode(path);
+        if (reportLookupError()) return;
         if (!node || !node->isDirectory) {
-            cout << "Error: Invalid directory" << endl;
+            fail() << "Error: Invalid directory" << endl;
             return;
         }
+        if (denyUnless(node, AccessExecute)) return;
 
         currentDirectory = node;  
+        cwdSnapshot = lastLookupSnapshot;
+        snapshotPath = lastLookupPath;
     }
 
-    void pwd() {
-        vector<string> path;
-        Node* node = currentDirectory;
+    // Absolute path of the working directory, including the snapshot
+    // mount point when inside one.
+    string workingPath() {
+        if (cwdSnapshot.empty()) return constructPath(currentDirectory);
 
-        while (node) {
-            path.push_back(node->name);
-            node = node->parent;
+        string path = "/.snapshots/" + cwdSnapshot;
+        for (size_t i = 1; i < snapshotPath.size(); ++i) {
+            path += "/" + snapshotPath[i]->name;
         }
+        return path;
+    }
 
-        if (path.empty()) {
-            cout << "/";
-        }
-        else {
-            for (auto it = path.rbegin(); it != path.rend(); ++it) {
-                cout << *it;
-                if (it + 1 != path.rend()) cout << "/";
-            }
+    void pwd() {
+        cout << workingPath() << endl;
+    }
+
+    struct ListOptions {
+        string sortKey = "name";
+        size_t limit = 0;
+        string after;
+        bool longFormat = false;
+    };
+
+    // mtime and size orders put the newest and largest first, with ties
+    // broken by name so a cursor position is always well defined.
+    static bool listsBefore(Node* a, Node* b, bool bySize) {
+        long long keyA = bySize ? (long long)(a->isDirectory ? a->dirInfo->subtreeBytes : a->fileSize) : (long long)a->modifiedAt;
+        long long keyB = bySize ? (long long)(b->isDirectory ? b->dirInfo->subtreeBytes : b->fileSize) : (long long)b->modifiedAt;
+        if (keyA != keyB) return keyA > keyB;
+        return a->name < b->name;
+    }
+
+    static string modeString(Node* node) {
+        string mode = node->isDirectory ? "d" : node->isSymLink ? "l" : "-";
+        for (int shift = 6; shift >= 0; shift -= 3) {
+            unsigned int bits = node->permissions >> shift;
+            mode += bits & 4 ? 'r' : '-';
+            mode += bits & 2 ? 'w' : '-';
+            mode += bits & 1 ? 'x' : '-';
         }
+        return mode;
+    }
 
+    static void printListEntry(Node* node, bool longFormat) {
+        if (!longFormat) {
+            cout << (node->isDirectory ? "[DIR] " : "[FILE] ") << node->name << endl;
+            return;
+        }
+        cout << modeString(node) << "\t" << node->owner << "\t"
+             << (node->isDirectory ? node->dirInfo->subtreeBytes : node->fileSize) << "\t" << node->modifiedAt << "\t" << node->name;
+        if (node->isSymLink) cout << " -> " << node->linkInfo->target;
         cout << endl;
     }
 
-    void ls() {
-        if (!currentDirectory) {
-            cout << "Error: Current directory is not set" << endl;
+    // Prints one page of a directory. In name order the page is read
+    // straight off the child index from the cursor, so it costs
+    // O(limit * log n) however large the directory is. mtime and size
+    // orders rank the entries past the cursor with a partial sort.
+    void ls(const string& path, const ListOptions& options) {
+        Node* dir = path.empty() ? currentDirectory : findNode(path);
+        if (reportLookupError()) return;
+        if (!dir) {
+            fail() << (path.empty() ? "Error: Current directory is not set" : "Error: Path not found") << endl;
+            return;
+        }
+        if (!dir->isDirectory) {
+            printListEntry(dir, options.longFormat);
             return;
         }
 
-        Node* child = currentDirectory->firstChild;
-        if (!child) {
+        if (denyUnless(dir, AccessRead)) return;
+
+        if (!dir->dirInfo->children) {
             cout << "No files or directories" << endl;
             return;
         }
 
-        while (child) {
-            cout << (child->isDirectory ? "[DIR] " : "[FILE] ") << child->name << endl;
-            child = child->nextSibling;
+        size_t limit = options.limit ? options.limit : dir->dirInfo->childCount;
+        bool bySize = options.sortKey == "size";
+        if (bySize || options.longFormat) flushRollups();
+
+        vector<Node*> page;
+        bool more = false;
+        if (options.sortKey == "name") {
+            Node* next = options.after.empty() ? ChildIndex::first(dir->dirInfo->children)
+                                               : ChildIndex::after(dir->dirInfo->children, options.after);
+            for (; next && page.size() < limit; next = ChildIndex::after(dir->dirInfo->children, next->name)) {
+                page.push_back(next);
+            }
+            more = next != nullptr;
+        }
+        else {
+            Node* cursor = options.after.empty() ? nullptr : findChild(dir, options.after);
+            if (!options.after.empty() && !cursor) {
+                fail() << "Error: No entry named '" << options.after << "' to continue after" << endl;
+                return;
+            }
+            ChildIndex::forEach(dir->dirInfo->children, [&](Node* child) {
+                if (!cursor || listsBefore(cursor, child, bySize)) page.push_back(child);
+            });
+            auto order = [bySize](Node* a, Node* b) { return listsBefore(a, b, bySize); };
+            more = page.size() > limit;
+            auto pageEnd = more ? page.begin() + limit : page.end();
+            partial_sort(page.begin(), pageEnd, page.end(), order);
+            page.erase(pageEnd, page.end());
+        }
+
+        if (page.empty()) {
+            cout << "No more entries" << endl;
+            return;
         }
+        for (Node* node : page) printListEntry(node, options.longFormat);
+        if (more) cout << "-- more entries: continue with --after " << page.back()->name << endl;
     }
 
     void touch(const string& path, const string& content = "") {
         if (exceedsMaxPathLength(path)) {
-            cout << "Error: Path length exceeds maximum allowed length of 255 characters" << endl;
+            fail() << "Error: Path length exceeds maximum allowed length of 255 characters" << endl;
             return;
         }
 
         size_t lastSlashPos = path.find_last_of('/');
         if (lastSlashPos == string::npos) {
-            cout << "Error: Invalid path, no directory specified" << endl;
+            fail() << "Error: Invalid path, no directory specified" << endl;
             return;
         }
 
@@ -306,174 +3287,201 @@ public:
         string fileName = path.substr(lastSlashPos + 1);
 
         if (fileName.empty()) {
-            cout << "Error: Invalid file name" << endl;
+            fail() << "Error: Invalid file name" << endl;
             return;
         }
 
         Node* parent = findNode(directoryPath);
+        if (reportLookupError()) return;
         if (!parent || !parent->isDirectory) {
-            cout << "Error: Invalid directory" << endl;
+            fail() << "Error: Invalid directory" << endl;
             return;
         }
+        if (rejectReadOnly()) return;
+        if (denyUnless(parent, AccessWrite | AccessExecute)) return;
 
-        Node* child = parent->firstChild;
-        while (child) {
-            if (child->name == fileName && !child->isDirectory) {
-                cout << "Error: File already exists" << endl;
-                return;
-            }
-            child = child->nextSibling;
+        if (Node* existing = findChild(parent, fileName)) {
+            fail() << (existing->isDirectory ? "Error: A directory with the same name already exists" : "Error: File already exists") << endl;
+            return;
         }
 
-        Node* newFile = new Node(fileName, false, parent);
-        newFile->content = content;
-        newFile->fileSize = content.size();
+        if (!checkQuota(parent, sessionUser, { (long long)content.size(), 1, 0 })) return;
+
+        parent = makeMutable(parent);
+        Node* newFile = newNode(fileName, false, parent);
+        newFile->owner = sessionUser;
+        chargeOwner(newFile->owner, content.size(), 1);
+        storeContent(newFile, content);
         newFile->modifiedAt = time(0);  
-        newFile->nextSibling = parent->firstChild;
-        parent->firstChild = newFile;
+        linkChild(parent, newFile);
+        applyUsage(parent, usageOf(newFile));
+        notify(FsEvent::Create, newFile);
     }
 
     void write(const string& fileName, const string& content) {
         Node* file = findNode(fileName);
+        if (reportLookupError()) return;
         if (!file || file->isDirectory) {
-            cout << "Error: Invalid file" << endl;
+            fail() << "Error: Invalid file" << endl;
             return;
         }
-        file->content = content;
-        file->fileSize = content.size();
+        if (rejectReadOnly()) return;
+        if (denyUnless(file, AccessWrite)) return;
+        UsageDelta delta = { (long long)content.size() - (long long)file->fileSize, 0, 0 };
+        if (!checkQuota(parentOf(file), file->owner, delta)) return;
+        file = makeMutable(file);
+        chargeOwner(file->owner, delta.bytes, 0);
+        applyUsage(parentOf(file), delta);
+        storeContent(file, content);
         file->modifiedAt = time(0); 
+        notify(FsEvent::Modify, file);
     }
 
     void cat(const string& fileName) {
         Node* file = findNode(fileName);
+        if (reportLookupError()) return;
         if (!file) {
-            cout << "Error: File does not exist" << endl;
+            fail() << "Error: File does not exist" << endl;
             return;
         }
         if (file->isDirectory) {
-            cout << "Error: " << fileName << " is a directory, not a file" << endl;
+            fail() << "Error: " << fileName << " is a directory, not a file" << endl;
             return;
         }
 
-        if (file->content.empty()) {
-            cout << "Error: File is empty" << endl;
+        if (denyUnless(file, AccessRead)) return;
+
+        if (file->fileSize == 0) {
+            fail() << "Error: File is empty" << endl;
             return;
         }
 
-        cout << file->content << endl;
+        cout << readContent(file) << endl;
     }
 
     void rm(const string& fileName) {
         if (exceedsMaxPathLength(fileName)) {
-            cout << "Error: Path length exceeds maximum allowed length of 255 characters" << endl;
+            fail() << "Error: Path length exceeds maximum allowed length of 255 characters" << endl;
             return;
         }
 
         Node* parent = findNode(fileName.substr(0, fileName.find_last_of('/')));
+        if (reportLookupError()) return;
         if (!parent || !parent->isDirectory) {
-            cout << "Error: Invalid path" << endl;
+            fail() << "Error: Invalid path" << endl;
             return;
         }
+        if (rejectReadOnly()) return;
+        if (denyUnless(parent, AccessWrite | AccessExecute)) return;
 
         string name = fileName.substr(fileName.find_last_of('/') + 1);
-        Node* child = parent->firstChild;
-        Node* prev = nullptr;
-
-        while (child && child->name != name) {
-            prev = child;
-            child = child->nextSibling;
-        }
-
+        Node* child = findChild(parent, name);
         if (!child || child->isDirectory) {
-            cout << "Error: File not found or it's a directory" << endl;
+            fail() << "Error: File not found or it's a directory" << endl;
             return;
         }
 
-        if (prev) {
-            prev->nextSibling = child->nextSibling;  
-        }
-        else {
-            parent->firstChild = child->nextSibling;  
-        }
+        parent = makeMutable(parent);
+        unlinkChild(parent, child);
 
-        delete child;  
+        applyUsage(parent, negate(usageOf(child)));
+        notify(FsEvent::Delete, child);
+        releaseNode(child);  
         cout << "File " << fileName << " deleted successfully" << endl;
     }
 
 
     void mv(const string& sourcePath, const string& destPath) {
-        Node* source = findNode(sourcePath);
+        Node* source = findNode(sourcePath, false);
+        if (reportLookupError()) return;
         if (!source) {
-            cout << "Error: Source path not found" << endl;
+            fail() << "Error: Source path not found" << endl;
+            return;
+        }
+        if (rejectReadOnly()) return;
+        if (!source->parent) {
+            fail() << "Error: Cannot move the root directory" << endl;
             return;
         }
 
         if (sourcePath == destPath) {
-            cout << "Error: Source and destination are the same" << endl;
+            fail() << "Error: Source and destination are the same" << endl;
             return;
         }
 
         string destParentPath = destPath.substr(0, destPath.find_last_of('/'));
         Node* destParent = findNode(destParentPath);
+        bool destReadOnly = isReadOnlyLookup();
 
         Node* dest = findNode(destPath);
         if (dest && dest->isDirectory) {
             destParent = dest;
+            destReadOnly = isReadOnlyLookup();
         }
         else {
             if (!destParent || !destParent->isDirectory) {
-                cout << "Error: Destination directory does not exist" << endl;
+                fail() << "Error: Destination directory does not exist" << endl;
                 return;
             }
         }
+        if (destReadOnly) {
+            fail() << "Error: Snapshots are read-only" << endl;
+            return;
+        }
+        if (isCircularReference(source, destParent)) {
+            fail() << "Error: Cannot move a directory into itself" << endl;
+            return;
+        }
+        if (denyUnless(parentOf(source), AccessWrite | AccessExecute)) return;
+        if (denyUnless(destParent, AccessWrite | AccessExecute)) return;
 
         string destName = destPath.substr(destPath.find_last_of('/') + 1);
         if (dest && dest->isDirectory) {
             destName = source->name;
         }
 
-        Node* child = destParent->firstChild;
-        while (child) {
-            if (child->name == destName) {
-                cout << "Error: A file or directory with the same name already exists at the destination" << endl;
-                return;
-            }
-            child = child->nextSibling;
+        if (findChild(destParent, destName)) {
+            fail() << "Error: A file or directory with the same name already exists at the destination" << endl;
+            return;
         }
 
-        source->name = destName;
-        source->modifiedAt = time(nullptr);  
-
-        Node* parent = source->parent;
-        if (parent->firstChild == source) {
-            parent->firstChild = source->nextSibling;
-        }
-        else {
-            Node* sibling = parent->firstChild;
-            while (sibling && sibling->nextSibling != source) {
-                sibling = sibling->nextSibling;
-            }
-            if (sibling) sibling->nextSibling = source->nextSibling;
+        Node* parent = parentOf(source);
+        string from = pathForMove(source);
+        flushRollups();
+        UsageDelta moved = usageOf(source);
+        if (!quotaDirs.empty()) {
+            unordered_set<Node*> shared;
+            for (Node* node = parent; node; node = parentOf(node)) shared.insert(node);
+            if (!checkQuota(destParent, "", moved, &shared)) return;
         }
+        parent = makeMutable(parent);
+        applyUsage(parent, negate(moved));
+        unlinkChild(parent, source);
+        if (isFrozen(source)) source = cloneNode(source);
+        destParent = makeMutable(live(destParent));
 
-        source->nextSibling = destParent->firstChild;
-        destParent->firstChild = source;
-        source->parent = destParent;
+        source->name = destName;
+        source->modifiedAt = time(nullptr);  
+        invalidateAccess();
+        linkChild(destParent, source);
+        applyUsage(destParent, moved);
+        notify(FsEvent::Move, source, from, parent);
 
         cout << "Successfully moved " << sourcePath << " to " << destPath << endl;
     }
 
-    void cp(const string& sourcePath, const string& destPath) {
-        Node* source = findNode(sourcePath);
+    // The checks cp and cp & share: where the copy goes, and whether it
+    // may go there.
+    bool resolveCopy(const string& sourcePath, const string& destPath, Node*& source, Node*& destParent,
+        string& destName) {
+        source = findNode(sourcePath);
+        if (reportLookupError()) return false;
         if (!source) {
-            cout << "Error: Source path not found" << endl;
-            return;
+            fail() << "Error: Source path not found" << endl;
+            return false;
         }
 
         Node* dest = findNode(destPath);
-        Node* destParent;
-        string destName;
-
         if (dest && dest->isDirectory) {
             destParent = dest;
             destName = source->name;
@@ -483,29 +3491,78 @@ public:
             destParent = findNode(destParentPath);
 
             if (!destParent || !destParent->isDirectory) {
-                cout << "Error: Destination path is invalid" << endl;
-                return;
+                fail() << "Error: Destination path is invalid" << endl;
+                return false;
             }
 
             destName = destPath.substr(destPath.find_last_of('/') + 1);
         }
 
-        Node* child = destParent->firstChild;
-        while (child) {
-            if (child->name == destName) {
-                cout << "Error: A file or directory with the same name already exists at the destination" << endl;
+        if (isReadOnlyLookup()) {
+            fail() << "Error: Snapshots are read-only" << endl;
+            return false;
+        }
+        if (isCircularReference(source, destParent)) {
+            fail() << "Error: Cannot copy a directory into itself" << endl;
+            return false;
+        }
+        if (denyUnless(destParent, AccessWrite | AccessExecute)) return false;
+        if (findChild(destParent, destName)) {
+            fail() << "Error: A file or directory with the same name already exists at the destination" << endl;
+            return false;
+        }
+        return true;
+    }
+
+    void cp(const string& sourcePath, const string& destPath) {
+        Node* source;
+        Node* destParent;
+        string destName;
+        if (!resolveCopy(sourcePath, destPath, source, destParent, destName)) return;
+        if (sessionUserId != 0) {
+            bool readable = true;
+            walkTree(source, [&](Node* node) {
+                unsigned char want = node->isDirectory ? AccessRead | AccessExecute : AccessRead;
+                if (canAccess(node, want)) return Visit::Continue;
+                readable = false;
+                return Visit::Stop;
+            });
+            if (!readable) {
+                fail() << "Error: Permission denied" << endl;
                 return;
             }
-            child = child->nextSibling;
         }
 
-        copyNode(source, destParent, destName);
+        flushRollups();
+        if (!ownerQuotas.empty()) {
+            unordered_map<string, UsageDelta> perOwner;
+            walkTree(source, [&perOwner](Node* node) {
+                UsageDelta& need = perOwner[node->owner];
+                if (node->isDirectory) ++need.dirs;
+                else {
+                    need.bytes += node->fileSize;
+                    ++need.files;
+                }
+                return Visit::Continue;
+            });
+            for (const auto& entry : perOwner) {
+                if (!checkQuota(nullptr, entry.first, entry.second)) return;
+            }
+        }
+        if (!checkQuota(destParent, "", usageOf(source))) return;
+
+        destParent = makeMutable(destParent);
+        Node* copy = copyNode(source, destParent, destName);
+        applyUsage(destParent, usageOf(copy));
+        notify(FsEvent::Create, copy);
         cout << "Successfully copied " << sourcePath << " to " << destPath << endl;
     }
-    void stat(const string& path) {
-        Node* node = findNode(path);
+    // stat reports the symlink target; lstat (followLink = false) the link.
+    void stat(const string& path, bool followLink = true) {
+        Node* node = findNode(path, followLink);
+        if (reportLookupError()) return;
         if (!node) {
-            cout << "Error: Path not found" << endl;
+            fail() << "Error: Path not found" << endl;
             return;
         }
 
@@ -516,17 +3573,496 @@ public:
         cout << "Created: " << node->createdAt << endl; 
         cout << "Modified: " << node->modifiedAt << endl; 
         if (node->isSymLink) {
-            cout << "Symbolic Link Target: " << node->linkTarget << endl;
+            cout << "Symbolic Link Target: " << node->linkInfo->target << endl;
+        }
+        if (!node->isDirectory) {
+            cout << "Size: " << node->fileSize << " bytes" << endl;
+            if (node->isChunked) {
+                cout << "Physical Size: " << node->chunks->size() * sizeof(uint64_t) << " bytes (deduplicated, "
+                    << node->chunks->size() << " chunks)" << endl;
+            }
+            else {
+                size_t stored = node->isSpilled ? node->spillLength : node->isPacked ? node->fileSize : node->content.size();
+                cout << "Physical Size: " << stored << " bytes" << (node->isCompressed ? " (compressed)" : "")
+                    << (node->isSpilled ? " (spilled)" : "") << (node->isPacked ? " (packed)" : "") << endl;
+            }
+        }
+        else {
+            flushRollups();
+            cout << "Subtree Size: " << node->dirInfo->subtreeBytes << " bytes" << endl;
+            cout << "Subtree Entries: " << node->dirInfo->subtreeFiles << " files, " << node->dirInfo->subtreeDirs << " directories" << endl;
+            cout << "Entries: " << node->dirInfo->childCount << endl;
+        }
+    }
+
+    void du(const string& path) {
+        Node* node = path.empty() ? currentDirectory : findNode(path);
+        if (!node) {
+            fail() << "Error: Path not found" << endl;
+            return;
+        }
+
+        if (!node->isDirectory) {
+            cout << node->fileSize << " bytes\t" << (path.empty() ? node->name : path) << endl;
+            return;
+        }
+
+        flushRollups();
+        cout << node->dirInfo->subtreeBytes << " bytes\t" << node->dirInfo->subtreeFiles << " files\t"
+            << node->dirInfo->subtreeDirs << " dirs\t" << (path.empty() ? "." : path) << endl;
+    }
+
+    void df() {
+        flushRollups();
+        cout << "Used: " << root->dirInfo->subtreeBytes << " bytes" << endl;
+        cout << "Files: " << root->dirInfo->subtreeFiles << endl;
+        cout << "Directories: " << root->dirInfo->subtreeDirs + 1 << endl;
+    }
+
+    // Compresses plain files that have not been read or written for at least
+    // `idleSeconds`. Small files are skipped since the codec cannot win there.
+    void compressCold(time_t idleSeconds) {
+        const size_t minimumSize = 64;
+        time_t cutoff = time(nullptr) - idleSeconds;
+        size_t count = 0, before = 0, after = 0;
+
+        walkTree(root, [&](Node* node) {
+            if (node->isDirectory || node->isCompressed || node->isSpilled ||
+                node->content.size() < minimumSize || node->accessedAt > cutoff) {
+                return Visit::Continue;
+            }
+            string packed = LZCodec::compress(node->content);
+            if (packed.size() < node->content.size()) {
+                before += node->content.size();
+                after += packed.size();
+                untrack(node);
+                node->content = move(packed);
+                node->content.shrink_to_fit();
+                node->isCompressed = true;
+                node->hasSpillCopy = false;
+                track(node);
+                ++count;
+            }
+            return Visit::Continue;
+        });
+
+        cout << "Compressed " << count << " files: " << before << " -> " << after << " bytes" << endl;
+    }
+
+    ostream& fail() {
+        ++failures;
+        return cout;
+    }
+
+    // Commands that have failed so far.
+    size_t failureCount() const {
+        return failures;
+    }
+
+    // A command that changes the tree failed. Only these roll back an open
+    // transaction: a failed cat or ls has nothing to undo.
+    void noteFailedChange() {
+        if (txn) ++txn->failedChanges;
+    }
+
+    void beginTransaction() {
+        if (txn) {
+            fail() << "Error: A transaction is already open" << endl;
+            return;
+        }
+        if (!jobs.empty()) {
+            fail() << "Error: Transactions cannot start while background jobs run" << endl;
+            return;
+        }
+
+        flushRollups();
+        txn.reset(new Transaction());
+        txn->root = root;
+        txn->currentDirectory = currentDirectory;
+        txn->cwdSnapshot = cwdSnapshot;
+        txn->snapshotPath = snapshotPath;
+        txn->snapshotFrozenBelow = frozenBelow;
+        txn->deferredRollups = deferRollups;
+        txn->ownerUsage = ownerUsage;
+        txn->ownerQuotas = ownerQuotas;
+        txn->quotaDirs = quotaDirs;
+        for (const auto& entry : watches) {
+            txn->watchPaths[entry.first] = { entry.second->path, entry.second->removed };
+        }
+        ++liveEpoch;
+        frozenBelow = liveEpoch;
+        txn->epoch = liveEpoch;
+        deferRollups = true;
+        cout << "Transaction started" << endl;
+    }
+
+    // Applies the parked rollups in one pass, frees the versions the
+    // transaction replaced, and only then delivers its notifications. If
+    // any operation inside failed, everything is rolled back instead.
+    void commitTransaction() {
+        if (!txn) {
+            fail() << "Error: No transaction is open" << endl;
+            return;
+        }
+        size_t failed = txn->failedChanges;
+        if (failed) {
+            rollbackTransaction();
+            fail() << "Error: Transaction rolled back, " << failed << " operation(s) failed" << endl;
+            return;
+        }
+
+        deferRollups = txn->deferredRollups;
+        flushRollups();
+
+        // An old version is garbage once it was copied or removed, unless a
+        // snapshot froze it before the transaction began.
+        unordered_set<Node*> retired(txn->retired.begin(), txn->retired.end());
+        vector<Node*> replaced;
+        walkTree(txn->root, [&](Node* node) {
+            if (node->epoch < txn->snapshotFrozenBelow) return Visit::SkipChildren;
+            if (!node->forward && !retired.count(node)) return Visit::SkipChildren;
+            replaced.push_back(node);
+            return Visit::Continue;
+        });
+        for (Node* node : replaced) destroyNode(node);
+
+        frozenBelow = txn->snapshotFrozenBelow;
+        vector<pair<int, FsEvent>> events = move(txn->events);
+        txn.reset();
+        for (const auto& event : events) publish(event.first, event.second);
+        cout << "Transaction committed" << endl;
+    }
+
+    void abortTransaction() {
+        if (!txn) {
+            fail() << "Error: No transaction is open" << endl;
+            return;
+        }
+        rollbackTransaction();
+        cout << "Transaction aborted" << endl;
+    }
+
+    // Turns on demand paging with `hostPath` as the spill file, or just
+    // moves the ceiling if it is already on. The LRU list starts out in
+    // access-time order, then the coldest files are evicted.
+    void enableSpill(const string& hostPath, size_t ceiling) {
+        if (sessionUserId != 0) {
+            fail() << "Error: Permission denied" << endl;
+            return;
+        }
+        if (spill.isOpen() && hostPath != spill.hostPath()) {
+            fail() << "Error: Spilling to '" << spill.hostPath() << "' already; run 'spill off' first" << endl;
+            return;
+        }
+        if (!spill.isOpen()) {
+            if (!spill.open(hostPath)) {
+                fail() << "Error: Unable to create spill file (it must not exist yet): " << hostPath << endl;
+                return;
+            }
+            unordered_set<Node*> nodes;
+            markAllReachable(nodes);
+            vector<Node*> files;
+            for (Node* node : nodes) {
+                if (!node->isDirectory && !node->content.empty()) files.push_back(node);
+            }
+            sort(files.begin(), files.end(), [](Node* a, Node* b) { return a->accessedAt < b->accessedAt; });
+            for (Node* file : files) track(file);
+            pageHits = pageFaults = evictions = 0;
+        }
+        memoryCeiling = ceiling;
+        enforceCeiling(nullptr);
+        cout << "Spilling to '" << hostPath << "' above " << ceiling << " resident bytes" << endl;
+    }
+
+    // Faults every spilled file back in and discards the spill file.
+    void disableSpill() {
+        if (!spill.isOpen()) {
+            fail() << "Error: Spilling is not enabled" << endl;
+            return;
+        }
+        if (sessionUserId != 0) {
+            fail() << "Error: Permission denied" << endl;
+            return;
+        }
+        unordered_set<Node*> nodes;
+        markAllReachable(nodes);
+        size_t ceiling = memoryCeiling;
+        memoryCeiling = SIZE_MAX;
+        bool allIn = true;
+        for (Node* node : nodes) {
+            if (node->isSpilled && !pageIn(node)) allIn = false;
+        }
+        if (!allIn) {
+            // The spill file still holds the only copy of those contents.
+            memoryCeiling = ceiling;
+            enforceCeiling(nullptr);
+            fail() << "Error: Spilling stays on" << endl;
+            return;
+        }
+        while (lruHead) lruUnlink(lruHead);
+        for (Node* node : nodes) node->hasSpillCopy = false;
+        residentBytes = residentFiles = 0;
+        memoryCeiling = 0;
+        spill.close();
+        cout << "Spilling disabled" << endl;
+    }
+
+    void spillStats() {
+        if (!spill.isOpen()) {
+            cout << "Spilling is off" << endl;
+            return;
+        }
+        size_t lookups = pageHits + pageFaults;
+        ostringstream rate;
+        rate.setf(ios::fixed);
+        rate.precision(1);
+        rate << (lookups ? 100.0 * pageHits / lookups : 100.0);
+        cout << "Spill file: " << spill.hostPath() << " (" << spill.size() << " bytes)" << endl;
+        cout << "Memory ceiling: " << memoryCeiling << " bytes" << endl;
+        cout << "Resident: " << residentBytes << " bytes in " << residentFiles << " files" << endl;
+        cout << "Spilled: " << spilledFiles << " files" << endl;
+        cout << "Hits: " << pageHits << ", faults: " << pageFaults << " (hit rate " << rate.str() << "%)" << endl;
+        cout << "Evictions: " << evictions << endl;
+    }
+
+    void addWatch(const string& path, bool recursive) {
+        Node* node = findNode(path);
+        if (reportLookupError()) return;
+        if (!node) {
+            fail() << "Error: Path not found" << endl;
+            return;
+        }
+        if (isReadOnlyLookup()) {
+            fail() << "Error: Snapshots cannot be watched" << endl;
+            return;
+        }
+        if (denyUnless(node, AccessRead)) return;
+
+        int id = nextWatchId++;
+        watches[id] = unique_ptr<Watch>(new Watch(node->inode, constructPath(node), recursive));
+        cout << "Watch " << id << " added on " << watches[id]->path << (recursive ? " (recursive)" : "") << endl;
+    }
+
+    void removeWatch(int id) {
+        if (!watches.erase(id)) {
+            fail() << "Error: No such watch" << endl;
+            return;
+        }
+        cout << "Watch " << id << " removed" << endl;
+    }
+
+    void listWatches() {
+        if (watches.empty()) {
+            cout << "No watches" << endl;
+            return;
+        }
+        for (const auto& entry : watches) {
+            const Watch& watch = *entry.second;
+            cout << entry.first << "\t" << watch.path << (watch.recursive ? " (recursive)" : "")
+                 << (watch.removed ? " (deleted)" : "")
+                 << "\tqueued " << watch.ring.size() << "\tdropped " << watch.ring.droppedEvents() << endl;
+        }
+    }
+
+    // Drains every queued event for the watch.
+    void tailWatch(int id) {
+        auto found = watches.find(id);
+        if (found == watches.end()) {
+            fail() << "Error: No such watch" << endl;
+            return;
+        }
+
+        static const char* kindNames[] = { "CREATE", "MODIFY", "DELETE", "MOVE", "ATTRIB", "OVERFLOW" };
+        FsEvent event;
+        bool any = false;
+        while (found->second->ring.pop(event)) {
+            any = true;
+            cout << kindNames[event.kind];
+            if (event.kind == FsEvent::Overflow) {
+                cout << " (events were dropped)" << endl;
+                continue;
+            }
+            cout << (event.isDirectory ? " [DIR] " : " ");
+            if (event.kind == FsEvent::Move) cout << event.from << " -> ";
+            cout << event.path << endl;
+        }
+        if (!any) cout << "No events" << endl;
+    }
+
+    void switchUser(const string& user) {
+        sessionUser = user;
+        sessionUserId = userId(user);
+        ++namespaceGeneration;
+        cout << "Switched to user '" << user << "'" << endl;
+    }
+
+    void whoami() {
+        cout << sessionUser << endl;
+    }
+
+    // O(1): bumping the epoch freezes every existing node in place.
+    void createSnapshot(const string& name) {
+        if (sessionUserId != 0) {
+            fail() << "Error: Permission denied" << endl;
+            return;
+        }
+        if (txn) {
+            fail() << "Error: Snapshots cannot be changed inside a transaction" << endl;
+            return;
+        }
+        if (snapshots.count(name)) {
+            fail() << "Error: Snapshot '" << name << "' already exists" << endl;
+            return;
+        }
+        if (name.find('/') != string::npos) {
+            fail() << "Error: Invalid snapshot name" << endl;
+            return;
+        }
+
+        flushRollups();
+        ++liveEpoch;
+        frozenBelow = liveEpoch;
+        snapshots[name] = { root, liveEpoch, time(nullptr) };
+        cout << "Snapshot '" << name << "' created" << endl;
+    }
+
+    // Frees the nodes only this snapshot still references.
+    void deleteSnapshot(const string& name) {
+        if (sessionUserId != 0) {
+            fail() << "Error: Permission denied" << endl;
+            return;
+        }
+        if (txn) {
+            fail() << "Error: Snapshots cannot be changed inside a transaction" << endl;
+            return;
+        }
+        auto found = snapshots.find(name);
+        if (found == snapshots.end()) {
+            fail() << "Error: Snapshot '" << name << "' not found" << endl;
+            return;
+        }
+
+        Node* snapshotRoot = found->second.root;
+        snapshots.erase(found);
+        if (cwdSnapshot == name) {
+            cwdSnapshot.clear();
+            snapshotPath.clear();
+            currentDirectory = root;
+        }
+
+        ++holderReleases;
+        size_t freed = freeOrphans({ snapshotRoot });
+        updateFrozenBelow();
+        cout << "Snapshot '" << name << "' deleted (" << freed << " nodes freed)" << endl;
+    }
+
+    void listSnapshots() {
+        if (snapshots.empty()) {
+            cout << "No snapshots" << endl;
+            return;
+        }
+        for (const auto& entry : snapshots) {
+            cout << entry.first << "\t" << entry.second.createdAt << "\t"
+                << entry.second.root->dirInfo->subtreeBytes << " bytes" << endl;
+        }
+    }
+
+    // Packing is on by default; the benchmarks turn it off for comparison.
+    void setPacking(bool enabled) {
+        packingEnabled = enabled;
+        cout << "Packing " << (enabled ? "enabled" : "disabled") << " for new writes" << endl;
+    }
+
+    void setDedup(bool enabled) {
+        dedupEnabled = enabled;
+        cout << "Deduplication " << (enabled ? "enabled" : "disabled") << " for new writes" << endl;
+    }
+
+    void dedupReport() {
+        cout << "Deduplication: " << (dedupEnabled ? "on" : "off") << endl;
+        cout << "Blocks: " << blockStore.blockCount() << endl;
+        cout << "Logical: " << blockStore.logical() << " bytes" << endl;
+        cout << "Unique: " << blockStore.unique() << " bytes" << endl;
+        cout << "Stored: " << blockStore.stored() << " bytes" << endl;
+        if (blockStore.unique()) {
+            cout << "Dedup Ratio: " << (double)blockStore.logical() / blockStore.unique() << endl;
+        }
+    }
+
+    void setOwnerQuota(const string& owner, size_t maxBytes, size_t maxInodes) {
+        if (sessionUserId != 0) {
+            fail() << "Error: Permission denied" << endl;
+            return;
+        }
+        if (!maxBytes && !maxInodes) {
+            ownerQuotas.erase(owner);
+        }
+        else {
+            ownerQuotas[owner] = { maxBytes, maxInodes };
+        }
+        cout << "Quota for owner '" << owner << "' updated successfully" << endl;
+    }
+
+    void setDirectoryQuota(const string& path, size_t maxBytes, size_t maxInodes) {
+        if (sessionUserId != 0) {
+            fail() << "Error: Permission denied" << endl;
+            return;
+        }
+        Node* dir = findNode(path);
+        if (!dir || !dir->isDirectory) {
+            fail() << "Error: Invalid directory" << endl;
+            return;
+        }
+        if (rejectReadOnly()) return;
+
+        // Deltas parked before the quota existed would leave its counters
+        // stale; from here on applyUsage keeps them exact.
+        if (maxBytes || maxInodes) flushRollups();
+        dir = makeMutable(dir);
+        dir->dirInfo->quotaBytes = maxBytes;
+        dir->dirInfo->quotaInodes = maxInodes;
+        if (maxBytes || maxInodes) {
+            quotaDirs.insert(dir);
+        }
+        else {
+            quotaDirs.erase(dir);
         }
-        if (!node->isDirectory) {
-            cout << "Size: " << node->fileSize << " bytes" << endl;
+        cout << "Quota for directory '" << path << "' updated successfully" << endl;
+    }
+
+    void quotaReport() {
+        flushRollups();
+        for (const auto& entry : ownerUsage) {
+            if (!entry.second.inodes) continue;
+            cout << "Owner " << entry.first << ": " << entry.second.bytes << " bytes, " << entry.second.inodes << " inodes";
+            auto quota = ownerQuotas.find(entry.first);
+            if (quota != ownerQuotas.end()) {
+                cout << " (limit " << quota->second.maxBytes << " bytes, " << quota->second.maxInodes << " inodes)";
+            }
+            cout << endl;
+        }
+        for (Node* dir : quotaDirs) {
+            cout << "Directory " << constructPath(dir) << ": " << dir->dirInfo->subtreeBytes << " bytes, "
+                << dir->dirInfo->subtreeFiles + dir->dirInfo->subtreeDirs << " inodes (limit " << dir->dirInfo->quotaBytes << " bytes, "
+                << dir->dirInfo->quotaInodes << " inodes)" << endl;
         }
     }
 
+    // Bulk mode parks rollup updates so that large loads pay for each
+    // affected directory once instead of once per inserted entry.
+    void beginBulkLoad() {
+        deferRollups = true;
+    }
+
+    void endBulkLoad() {
+        deferRollups = (bool)txn;
+        flushRollups();
+    }
+
     void saveToFile(const string& filename) {
         ofstream out(filename); 
         if (!out) {
-            cout << "Error opening file for writing." << endl;
+            fail() << "Error opening file for writing." << endl;
             return;
         }
 
@@ -539,128 +4075,422 @@ public:
 
     void loadFromFile(const string& filename, Node* targetNode) {
         if (!targetNode || targetNode->isDirectory) {
-            cout << "Error: Target node is invalid or a directory." << endl;
+            fail() << "Error: Target node is invalid or a directory." << endl;
             return;
         }
 
-        ifstream in(filename);
-        if (!in) {
-            cout << "Error: Unable to open file for reading: " << filename << endl;
+        string content;
+        if (!readHostFile(filename, content)) {
+            fail() << "Error: Unable to open file for reading: " << filename << endl;
             return;
         }
 
-        deserializeNode(in, targetNode);
+        deserializeNode(content, targetNode);
 
-        in.close();
         cout << "File content successfully loaded into node: " << targetNode->name << endl;
     }
 
 
 
+    // Copies a host directory tree into a new directory at `path`. Host
+    // files are read by a pool of threads, a batch at a time; nodes are
+    // built on this thread with each directory's children linked in one
+    // pass, and the finished subtree is attached with a single rollup.
+    void importTree(const string& hostDir, const string& path) {
+        error_code ec;
+        if (!filesystem::is_directory(hostDir, ec)) {
+            fail() << "Error: Host directory not found: " << hostDir << endl;
+            return;
+        }
+
+        size_t lastSlash = path.find_last_of('/');
+        string parentPath = lastSlash == string::npos ? "" : path.substr(0, lastSlash == 0 ? 1 : lastSlash);
+        string name = path.substr(lastSlash == string::npos ? 0 : lastSlash + 1);
+        Node* destParent = findNode(parentPath);
+        if (reportLookupError()) return;
+        if (!destParent || !destParent->isDirectory || name.empty()) {
+            fail() << "Error: Invalid path" << endl;
+            return;
+        }
+        if (rejectReadOnly()) return;
+        if (denyUnless(destParent, AccessWrite | AccessExecute)) return;
+        if (findChild(destParent, name)) {
+            fail() << "Error: A file or directory with the same name already exists at the destination" << endl;
+            return;
+        }
+
+        struct ImportDir {
+            Node* node;
+            vector<Node*> children;
+        };
+        struct ImportFile {
+            string hostPath;
+            size_t size;
+            Node* node;
+        };
+
+        auto started = chrono::steady_clock::now();
+        vector<ImportDir> dirs;
+        vector<ImportFile> files;
+        unordered_map<string, size_t> dirIndex;
+        UsageDelta total = { 0, 0, 1 };
+        unordered_map<string, UsageDelta> perOwner;
+        size_t skipped = 0;
+
+        filesystem::path hostRoot = filesystem::path(hostDir).lexically_normal();
+        if (!hostRoot.has_filename()) hostRoot = hostRoot.parent_path();
+
+        // An .owners manifest written by export restores modes, and owners
+        // too when root is importing.
+        unordered_map<string, pair<string, unsigned int>> manifest;
+        ifstream owners(hostRoot / ".owners");
+        string line;
+        while (getline(owners, line)) {
+            size_t first = line.find('\t');
+            size_t second = first == string::npos ? first : line.find('\t', first + 1);
+            if (second == string::npos) continue;
+            unsigned int mode = (unsigned int)strtoul(line.substr(first + 1, second - first - 1).c_str(), nullptr, 8);
+            manifest[line.substr(second + 1)] = { line.substr(0, first), mode };
+        }
+
+        Node* top = newNode(name, true, destParent);
+        top->owner = sessionUser;
+        top->modifiedAt = hostTime(filesystem::last_write_time(hostRoot, ec));
+        dirs.push_back({ top, {} });
+        dirIndex[hostRoot.string()] = 0;
+        ++perOwner[sessionUser].dirs;
+
+        filesystem::recursive_directory_iterator it(hostDir, filesystem::directory_options::skip_permission_denied, ec);
+        for (; !ec && it != filesystem::recursive_directory_iterator(); it.increment(ec)) {
+            const filesystem::directory_entry& entry = *it;
+            filesystem::path entryPath = entry.path().lexically_normal();
+            string relative = entryPath.lexically_relative(hostRoot).generic_string();
+            if (!manifest.empty() && relative == ".owners") continue;
+            auto parent = dirIndex.find(entryPath.parent_path().string());
+            bool isLink = entry.is_symlink(ec);
+            bool isDir = !isLink && entry.is_directory(ec);
+            if (parent == dirIndex.end() || isLink || (!isDir && !entry.is_regular_file(ec))) {
+                if (isDir) it.disable_recursion_pending();
+                ++skipped;
+                continue;
+            }
+
+            Node* node = newNode(entry.path().filename().string(), isDir, dirs[parent->second].node);
+            node->owner = sessionUser;
+            node->modifiedAt = hostTime(entry.last_write_time(ec));
+            auto meta = manifest.find(relative);
+            if (meta != manifest.end()) {
+                node->permissions = meta->second.second;
+                if (sessionUserId == 0) node->owner = meta->second.first;
+            }
+            dirs[parent->second].children.push_back(node);
+            UsageDelta& owned = perOwner[node->owner];
+            if (isDir) {
+                dirIndex[entryPath.string()] = dirs.size();
+                dirs.push_back({ node, {} });
+                ++total.dirs;
+                ++owned.dirs;
+            }
+            else {
+                size_t size = (size_t)entry.file_size(ec);
+                files.push_back({ entryPath.string(), size, node });
+                total.bytes += size;
+                ++total.files;
+                owned.bytes += size;
+                ++owned.files;
+            }
+        }
+
+        bool allowed = checkQuota(destParent, "", total);
+        for (auto entry = perOwner.begin(); allowed && entry != perOwner.end(); ++entry) {
+            allowed = checkQuota(nullptr, entry->first, entry->second);
+        }
+        if (!allowed) {
+            for (ImportDir& dir : dirs) {
+                for (Node* child : dir.children) destroyNode(child);
+            }
+            destroyNode(top);
+            return;
+        }
+
+        unordered_set<Node*> failed;
+
+        static constexpr size_t batchBytes = 64 << 20;
+        unsigned workers = max(1u, min(8u, thread::hardware_concurrency()));
+        vector<string> buffers;
+        vector<char> readOk;
+        size_t bytesRead = 0;
+        for (size_t first = 0; first < files.size();) {
+            size_t last = first, bytes = 0;
+            while (last < files.size() && (last == first || bytes < batchBytes)) bytes += files[last++].size;
+
+            buffers.assign(last - first, string());
+            readOk.assign(last - first, 0);
+            atomic<size_t> cursor(first);
+            auto reader = [&]() {
+                for (size_t i; (i = cursor.fetch_add(1)) < last;) {
+                    readOk[i - first] = readHostFile(files[i].hostPath, buffers[i - first]);
+                }
+            };
+            vector<thread> pool;
+            for (unsigned w = 1; w < workers && w < last - first; ++w) pool.emplace_back(reader);
+            reader();
+            for (thread& worker : pool) worker.join();
+
+            // Compression and the block store are single-threaded.
+            for (size_t i = first; i < last; ++i) {
+                Node* node = files[i].node;
+                if (!readOk[i - first]) {
+                    failed.insert(node);
+                    continue;
+                }
+                time_t modifiedAt = node->modifiedAt;
+                storeContent(node, buffers[i - first]);
+                node->modifiedAt = modifiedAt;
+                bytesRead += node->fileSize;
+            }
+            first = last;
+        }
+
+        // Children come after their parent in pre-order, so walking the
+        // directories backwards sees every subtree total before it is used.
+        for (size_t d = dirs.size(); d-- > 0;) {
+            ImportDir& dir = dirs[d];
+            for (Node* child : dir.children) {
+                if (failed.count(child)) {
+                    destroyNode(child);
+                    continue;
+                }
+                addUsage(dir.node, usageOf(child));
+                chargeOwner(child->owner, child->isDirectory ? 0 : child->fileSize, 1);
+                ++dir.node->dirInfo->childCount;
+                indexChild(dir.node, child);
+            }
+        }
+        UsageDelta imported = usageOf(top);
+
+        destParent = makeMutable(destParent);
+        linkChild(destParent, top);
+        applyUsage(destParent, imported);
+        chargeOwner(top->owner, 0, 1);
+        notify(FsEvent::Create, top);
+
+        double seconds = chrono::duration<double>(chrono::steady_clock::now() - started).count();
+        double megabytes = bytesRead / 1048576.0;
+        ostringstream report;
+        report.setf(ios::fixed);
+        report.precision(2);
+        // The totals count `top` itself, which is the target, not something
+        // found on the host.
+        report << "Imported " << imported.files << " files and " << top->dirInfo->subtreeDirs << " directories ("
+               << megabytes << " MB) in " << seconds << " s: "
+               << (seconds > 0 ? imported.files / seconds : 0) << " files/s, "
+               << (seconds > 0 ? megabytes / seconds : 0) << " MB/s";
+        if (!failed.empty()) report << ", " << failed.size() << " unreadable files skipped";
+        if (skipped) report << ", " << skipped << " special entries skipped";
+        cout << report.str() << endl;
+    }
+
+    // Writes the subtree at `path` to a ustar archive when `target` ends in
+    // ".tar", otherwise into the host directory `target`. Entries are
+    // relative to `path`, so import of an exported directory round-trips.
+    void exportTree(const string& path, const string& target, unsigned threads) {
+        Node* source = findNode(path);
+        if (reportLookupError()) return;
+        if (!source || !source->isDirectory) {
+            fail() << "Error: Export source must be a directory" << endl;
+            return;
+        }
+        if (denyUnless(source, AccessRead | AccessExecute)) return;
+
+        auto started = chrono::steady_clock::now();
+        flushRollups();
+        vector<ExportEntry> entries;
+        size_t skipped = 0;
+        collectExport(source, entries, skipped);
+
+        bool toTar = target.size() > 4 && target.compare(target.size() - 4, 4, ".tar") == 0;
+        bool ok = toTar ? exportTar(entries, target, skipped)
+                        : exportDirectory(entries, target, max(1u, threads), skipped);
+        if (!ok) return;
+
+        size_t fileCount = 0, dirCount = 0;
+        double megabytes = 0;
+        for (const ExportEntry& entry : entries) {
+            if (entry.node->isDirectory) ++dirCount;
+            else ++fileCount;
+            if (!entry.node->isDirectory && !entry.node->isSymLink) megabytes += entry.node->fileSize;
+        }
+        megabytes /= 1048576.0;
+
+        double seconds = chrono::duration<double>(chrono::steady_clock::now() - started).count();
+        ostringstream report;
+        report.setf(ios::fixed);
+        report.precision(2);
+        report << "Exported " << fileCount << " files and " << dirCount << " directories ("
+               << megabytes << " MB) in " << seconds << " s: "
+               << (seconds > 0 ? fileCount / seconds : 0) << " files/s, "
+               << (seconds > 0 ? megabytes / seconds : 0) << " MB/s";
+        if (skipped) report << ", " << skipped << " entries skipped";
+        cout << report.str() << endl;
+    }
+
     void rename(string oldName, string newName) {
-        Node* target = findNode(oldName);
+        Node* target = findNode(oldName, false);
+        if (reportLookupError()) return;
         if (!target) {
-            cout << "Error: File or directory not found.\n";
+            fail() << "Error: File or directory not found.\n";
             return;
         }
+        if (rejectReadOnly()) return;
+        if (!target->parent) {
+            fail() << "Error: Cannot rename the root directory.\n";
+            return;
+        }
+        if (denyUnless(parentOf(target), AccessWrite | AccessExecute)) return;
 
-        Node* parent = target->parent;
-        Node* child = parent->firstChild;
-        while (child) {
-            if (child->name == newName) {
-                cout << "Error: A file or directory with the new name already exists.\n";
-                return;
-            }
-            child = child->nextSibling;
+        if (findChild(parentOf(target), newName)) {
+            fail() << "Error: A file or directory with the new name already exists.\n";
+            return;
         }
 
+        string from = pathForMove(target);
+        target = makeMutable(target);
+        ++namespaceGeneration;
+        unindexChild(parentOf(target), target);
         target->name = newName;
+        indexChild(parentOf(target), target);
         target->modifiedAt = time(nullptr);  
+        notify(FsEvent::Move, target, from);
         cout << "Renamed successfully.\n";
     }
 
     void rmdir(string path) {
-        Node* target = findNode(path);
+        Node* target = findNode(path, false);
+        if (reportLookupError()) return;
         if (!target) {
-            cout << "Error: Directory not found.\n";
+            fail() << "Error: Directory not found.\n";
             return;
         }
+        if (rejectReadOnly()) return;
         if (target->parent == nullptr) {
-            cout << "Error: Cannot delete the root directory.\n";
+            fail() << "Error: Cannot delete the root directory.\n";
             return;
         }
-        Node* parent = target->parent;
-        if (parent->firstChild == target) {
-            parent->firstChild = target->nextSibling;
+        if (cwdSnapshot.empty() && isCircularReference(target, currentDirectory)) {
+            fail() << "Error: Cannot remove the working directory or one of its parents.\n";
+            return;
         }
-        else {
-            Node* sibling = parent->firstChild;
-            while (sibling->nextSibling != target) {
-                sibling = sibling->nextSibling;
-            }
-            sibling->nextSibling = target->nextSibling;
+        if (denyUnless(parentOf(target), AccessWrite | AccessExecute)) return;
+        Node* parent = makeMutable(parentOf(target));
+        unlinkChild(parent, target);
+
+        applyUsage(parent, negate(usageOf(target)));
+        notify(FsEvent::Delete, target);
+        if (target->isDirectory) {
+            deleteTree(target);
         }
-
-        delete target;  
+        releaseNode(target);  
         cout << "Directory removed successfully.\n";
     }
 
+    // Relative targets are resolved from the directory holding the link,
+    // both here and whenever the link is followed.
     void createSymlink(const string& targetPath, const string& linkName) {
-        Node* target = findNode(targetPath);
-        if (!target) {
-            cout << "Error: Target not found.\n";
+        size_t lastSlash = linkName.find_last_of('/');
+        string name = lastSlash == string::npos ? linkName : linkName.substr(lastSlash + 1);
+        Node* parent = lastSlash == string::npos ? currentDirectory : findNode(linkName.substr(0, lastSlash));
+        if (lastSlash == string::npos) {
+            lastLookupReadOnly = !cwdSnapshot.empty();
+        }
+        if (reportLookupError()) return;
+        if (!parent || !parent->isDirectory || name.empty()) {
+            fail() << "Error: Invalid link path.\n";
+            return;
+        }
+        if (rejectReadOnly()) return;
+        if (denyUnless(parent, AccessWrite | AccessExecute)) return;
+
+        PathState at = { parent, "", {} };
+        int hops = 0;
+        lastLookupError = LookupError::None;
+        if (!resolvePath(at, targetPath, true, hops)) {
+            if (!reportLookupError()) fail() << "Error: Target not found.\n";
             return;
         }
 
-        Node* existingLink = findNode(linkName);
-        if (existingLink) {
-            cout << "Error: A file or symlink with the name '" << linkName << "' already exists.\n";
+        if (findChild(parent, name)) {
+            fail() << "Error: A file or symlink with the name '" << linkName << "' already exists.\n";
             return;
         }
 
-        Node* symlink = new Node();
-        symlink->name = linkName;
+        if (!checkQuota(parent, sessionUser, { 0, 1, 0 })) return;
+
+        parent = makeMutable(parent);
+        Node* symlink = newNode(name, false, parent);
+        symlink->owner = sessionUser;
+        chargeOwner(symlink->owner, 0, 1);
         symlink->isSymLink = true;
-        symlink->linkTarget = targetPath;
+        symlink->linkInfo.create();
+        symlink->linkInfo->target = targetPath;
         symlink->createdAt = symlink->modifiedAt = time(nullptr);
-        symlink->parent = currentDirectory;
 
-        if (!currentDirectory->firstChild) {
-            currentDirectory->firstChild = symlink;
-        }
-        else {
-            Node* sibling = currentDirectory->firstChild;
-            while (sibling->nextSibling) {
-                sibling = sibling->nextSibling;
-            }
-            sibling->nextSibling = symlink;
-        }
+        linkChild(parent, symlink);
+        applyUsage(parent, usageOf(symlink));
+        notify(FsEvent::Create, symlink);
 
         cout << "Symbolic link '" << linkName << "' created successfully, pointing to '" << targetPath << "'.\n";
     }
 
     void chmod(const string& path, unsigned int mode) {
         Node* target = findNode(path);
+        if (reportLookupError()) return;
         if (!target) {
-            cout << "Error: File or directory not found.\n";
+            fail() << "Error: File or directory not found.\n";
             return;
         }
 
+        if (rejectReadOnly()) return;
+        if (sessionUserId != 0 && target->owner != sessionUser) {
+            fail() << "Error: Permission denied.\n";
+            return;
+        }
+
+        target = makeMutable(target);
         target->permissions = mode;
         target->modifiedAt = time(nullptr);
+        invalidateAccess();
+        notify(FsEvent::Attrib, target);
 
         cout << "Permissions for '" << path << "' updated successfully.\n";
     }
 
     void chown(const string& path, const string& newOwner) {
         Node* target = findNode(path);
+        if (reportLookupError()) return;
         if (!target) {
-            cout << "Error: File or directory not found.\n";
+            fail() << "Error: File or directory not found.\n";
+            return;
+        }
+
+        if (rejectReadOnly()) return;
+        if (sessionUserId != 0) {
+            fail() << "Error: Permission denied.\n";
             return;
         }
 
+        if (target->owner != newOwner) {
+            long long bytes = target->isDirectory ? 0 : target->fileSize;
+            if (!checkQuota(nullptr, newOwner, { bytes, 1, 0 })) return;
+            chargeOwner(target->owner, -bytes, -1);
+            chargeOwner(newOwner, bytes, 1);
+        }
+
+        target = makeMutable(target);
         target->owner = newOwner;
         target->modifiedAt = time(nullptr);
+        invalidateAccess();
+        notify(FsEvent::Attrib, target);
 
         cout << "Ownership of '" << path << "' updated successfully to '" << newOwner << "'.\n";
     }
@@ -679,150 +4509,277 @@ public:
         if (!node) return "";
 
         vector<string> pathParts;
-        while (node) {
+        while (node && parentOf(node)) {
             pathParts.push_back(node->name);
-            node = node->parent;
+            node = parentOf(node);
         }
+        if (pathParts.empty()) return "/";
 
         reverse(pathParts.begin(), pathParts.end()); 
 
-        string fullPath = "/";
+        string fullPath;
         for (const string& part : pathParts) {
-            fullPath += part + "/";
+            fullPath += "/" + part;
         }
-        return fullPath.substr(0, fullPath.size() - 1);
+        return fullPath;
     }
 
-    void find(const string& pattern) {
-        if (!currentDirectory) {
-            cout << "Error: Current directory is null.\n";
-            return;
-        }
-
-        vector<Node*> results;
-        queue<Node*> nodesToProcess;
-        nodesToProcess.push(currentDirectory);
-
-        while (!nodesToProcess.empty()) {
-            Node* node = nodesToProcess.front();
-            nodesToProcess.pop();
-
-            if (!node) continue;
-
-            if (node->name.find(pattern) != string::npos) { 
-                results.push_back(node);
-            }
-
-            if (node->firstChild) {
-                nodesToProcess.push(node->firstChild);
-            }
-            if (node->nextSibling) {
-                nodesToProcess.push(node->nextSibling);
-            }
+    // Walks the working directory and returns the paths of nodes whose
+    // name satisfies `matches`. Paths come from the cursor's own stack, so
+    // this also works inside snapshots.
+    template <typename Predicate>
+    vector<pair<string, Node*>> findMatches(Predicate matches) {
+        vector<pair<string, Node*>> results;
+        string base = workingPath();
+        if (base == "/") base.clear();
+
+        TreeCursor cursor(currentDirectory);
+        vector<Node*> trail;
+        Node* node;
+        TreeCursor::Phase phase;
+        while (cursor.next(node, phase)) {
+            if (phase != TreeCursor::PreOrder) continue;
+            if (node->isDirectory && !canAccess(node, AccessRead | AccessExecute)) cursor.skipChildren();
+            if (!matches(node)) continue;
+            cursor.currentPath(trail);
+            string path = base;
+            for (size_t i = 1; i < trail.size(); ++i) path += "/" + trail[i]->name;
+            results.push_back({ path.empty() ? "/" : path, node });
         }
+        return results;
+    }
 
+    void printMatches(const vector<pair<string, Node*>>& results) {
         if (results.empty()) {
             cout << "No matches found.\n";
         }
         else {
-            for (Node* result : results) {
-                cout << constructPath(result) << " (" << (result->isDirectory ? "directory" : "file") << ")\n";
+            for (const auto& result : results) {
+                cout << result.first << " (" << (result.second->isDirectory ? "directory" : "file") << ")\n";
             }
         }
     }
 
-    void findInsensitive(const string& pattern) {
+    void find(const string& pattern) {
         if (!currentDirectory) {
-            cout << "Error: Current directory is null.\n";
+            fail() << "Error: Current directory is null.\n";
             return;
         }
 
-        vector<Node*> results;
-        queue<Node*> nodesToProcess;
-        nodesToProcess.push(currentDirectory);
-
-        string searchPattern = toLower(pattern);
+        printMatches(findMatches([&pattern](Node* node) {
+            return node->name.find(pattern) != string::npos;
+        }));
+    }
 
-        while (!nodesToProcess.empty()) {
-            Node* node = nodesToProcess.front();
-            nodesToProcess.pop();
+    void findInsensitive(const string& pattern) {
+        if (!currentDirectory) {
+            fail() << "Error: Current directory is null.\n";
+            return;
+        }
 
-            if (!node) continue;
+        string searchPattern = toLower(pattern);
+        printMatches(findMatches([&](Node* node) {
+            return toLower(node->name).find(searchPattern) != string::npos;
+        }));
+    }
 
-            string nodeName = toLower(node->name); 
+    void grep(const string& content) {
+        vector<Node*> results;
 
-            if (nodeName.find(searchPattern) != string::npos) { 
-                results.push_back(node);
-            }
+        if (!currentDirectory) {
+            fail() << "Error: Current directory is null.\n";
+            return;
+        }
 
-            if (node->firstChild) {
-                nodesToProcess.push(node->firstChild);
+        walkTree(currentDirectory, [&](Node* node) {
+            if (node->isDirectory) {
+                return canAccess(node, AccessRead | AccessExecute) ? Visit::Continue : Visit::SkipChildren;
             }
-            if (node->nextSibling) {
-                nodesToProcess.push(node->nextSibling);
+            if (canAccess(node, AccessRead) && readContent(node).find(content) != string::npos) {
+                results.push_back(node);
             }
-        }
+            return Visit::Continue;
+        });
 
         if (results.empty()) {
-            cout << "No matches found.\n";
+            cout << "No files contain the specified content.\n";
         }
         else {
             for (Node* result : results) {
-                cout << constructPath(result) << " (" << (result->isDirectory ? "directory" : "file") << ")\n";
+                cout << "File: " << result->name << " contains the specified content.\n";
             }
         }
     }
 
-    void grep(const string& content) {
-        vector<Node*> results;
-        queue<Node*> nodesToProcess;
-
-        if (!currentDirectory) {
-            cout << "Error: Current directory is null.\n";
+    // Background variants of save, load, grep, cp and rmdir. Each checks
+    // its arguments right away, starts a job and returns; the job reports
+    // its result as "[job N] ..." lines and `onProgress`, if given, is
+    // called at every checkpoint.
+    void saveAsync(const string& filename, ProgressFn onProgress = nullptr) {
+        if (refuseJob()) return;
+        ofstream out(filename);
+        if (!out) {
+            fail() << "Error opening file for writing." << endl;
             return;
         }
+        Job& job = newJob("save " + filename, true, move(onProgress));
+        pinView(job, root);
+        job.total = entriesUnder(usageOf(root));
+        launch(job, saveJob(job, move(out), filename));
+    }
 
-        nodesToProcess.push(currentDirectory);
+    void loadAsync(const string& filename, Node* targetNode, ProgressFn onProgress = nullptr) {
+        if (refuseJob()) return;
+        if (!targetNode || targetNode->isDirectory) {
+            fail() << "Error: Target node is invalid or a directory." << endl;
+            return;
+        }
+        ifstream in(filename, ios::binary);
+        streamoff size = in ? (streamoff)in.seekg(0, ios::end).tellg() : -1;
+        if (size < 0) {
+            fail() << "Error: Unable to open file for reading: " << filename << endl;
+            return;
+        }
+        in.seekg(0, ios::beg);
+        string targetPath = constructPath(targetNode);
+        Job& job = newJob("load " + filename + " " + targetPath, true, move(onProgress));
+        job.total = (size_t)size;
+        launch(job, loadJob(job, move(in), filename, targetPath));
+    }
 
-        while (!nodesToProcess.empty()) {
-            Node* node = nodesToProcess.front();
-            nodesToProcess.pop();
+    void grepAsync(const string& content, ProgressFn onProgress = nullptr) {
+        if (refuseJob()) return;
+        Job& job = newJob("grep " + content, true, move(onProgress));
+        pinView(job, currentDirectory);
+        job.total = entriesUnder(usageOf(currentDirectory));
+        launch(job, grepJob(job, content));
+    }
 
-            if (!node) continue;
+    void cpAsync(const string& sourcePath, const string& destPath, ProgressFn onProgress = nullptr) {
+        if (refuseJob()) return;
+        Node* source;
+        Node* destParent;
+        string destName;
+        if (!resolveCopy(sourcePath, destPath, source, destParent, destName)) return;
+        string destDirPath = constructPath(destParent);
+        Job& job = newJob("cp " + sourcePath + " " + destPath, true, move(onProgress));
+        pinView(job, source);
+        job.total = entriesUnder(usageOf(source));
+        launch(job, copyJob(job, destDirPath, destName, sourcePath + " to " + destPath));
+    }
 
-            if (!node->isDirectory && node->content.find(content) != string::npos) {
-                results.push_back(node);
-            }
+    // The directory disappears at once; freeing it happens in the
+    // background and, having started, cannot be cancelled.
+    void rmdirAsync(const string& path, ProgressFn onProgress = nullptr) {
+        if (refuseJob()) return;
+        Node* target = findNode(path, false);
+        if (reportLookupError()) return;
+        if (!target) {
+            fail() << "Error: Directory not found.\n";
+            return;
+        }
+        if (rejectReadOnly()) return;
+        if (target->parent == nullptr) {
+            fail() << "Error: Cannot delete the root directory.\n";
+            return;
+        }
+        if (cwdSnapshot.empty() && isCircularReference(target, currentDirectory)) {
+            fail() << "Error: Cannot remove the working directory or one of its parents.\n";
+            return;
+        }
+        if (denyUnless(parentOf(target), AccessWrite | AccessExecute)) return;
+        flushRollups();
+        UsageDelta usage = usageOf(target);
+        Node* parent = makeMutable(parentOf(target));
+        unlinkChild(parent, target);
+        applyUsage(parent, negate(usage));
+        notify(FsEvent::Delete, target);
+
+        Job& job = newJob("rmdir " + path, false, move(onProgress));
+        job.held = target;
+        job.total = entriesUnder(usage);
+        launch(job, rmdirJob(job, target, frozenBelow, holderReleases));
+    }
 
-            if (node->firstChild) {
-                nodesToProcess.push(node->firstChild);
-            }
-            if (node->nextSibling) {
-                nodesToProcess.push(node->nextSibling);
-            }
+    void listJobs() {
+        if (jobs.empty()) {
+            cout << "No background jobs" << endl;
+            return;
+        }
+        for (const auto& entry : jobs) {
+            const Job& job = *entry.second;
+            cout << "[" << job.id << "] " << job.description << "  " << job.done << "/" << job.total
+                 << (job.cancelRequested ? "  (cancelling)" : "") << endl;
         }
+    }
 
-        if (results.empty()) {
-            cout << "No files contain the specified content.\n";
+    void cancelJob(int id) {
+        auto found = jobs.find(id);
+        if (found == jobs.end()) {
+            fail() << "Error: No job " << id << endl;
+            return;
         }
-        else {
-            for (Node* result : results) {
-                cout << "File: " << result->name << " contains the specified content.\n";
-            }
+        if (!found->second->cancellable) {
+            fail() << "Error: Job " << id << " cannot be cancelled" << endl;
+            return;
+        }
+        found->second->cancelRequested = true;
+        cout << "Cancelling job " << id << endl;
+    }
+
+    // Waits for job `id`, or for every job when `id` is 0. `hold` is the
+    // caller's lock from foreground(), which the wait lends to the jobs
+    // until they are done.
+    void waitForJobs(int id, unique_lock<mutex>& hold) {
+        if (id && !jobs.count(id)) {
+            fail() << "Error: No job " << id << endl;
+            return;
         }
+        jobsChanged.wait(hold, [this, id] { return id ? !jobs.count(id) : jobs.empty(); });
+    }
+
+    // Held by the CLI while it runs a command. Background jobs run between
+    // commands and give way to a command that is waiting.
+    unique_lock<mutex> foreground() {
+        ++foregroundWaiting;
+        unique_lock<mutex> hold(stateLock);
+        if (--foregroundWaiting == 0) foregroundDone.notify_all();
+        return hold;
     }
 };
 
+// Runs one CLI command under the foreground lock.
 void executeCommand(const string& command, FileSystem& fs) {
-    stringstream ss(command);
+    unique_lock<mutex> hold = fs.foreground();
+    string line = command;
     string cmd;
+    stringstream(line) >> cmd;
+
+    // A standalone "&" at the end runs save, load, grep, cp or rmdir as a
+    // background job. Any other '&' is part of the arguments.
+    bool background = false;
+    if (cmd == "save" || cmd == "load" || cmd == "grep" || cmd == "cp" || cmd == "rmdir") {
+        size_t last = line.find_last_not_of(" \t");
+        if (line[last] == '&' && (line[last - 1] == ' ' || line[last - 1] == '\t')) {
+            background = true;
+            line.erase(last);
+        }
+    }
+
+    static const unordered_set<string> changesTree = {
+        "mkdir", "touch", "write", "rm", "mv", "cp", "quota", "compress", "dedup", "bulk",
+        "load", "import", "rename", "rmdir", "createSymlink", "chmod", "chown"
+    };
+    size_t failuresBefore = fs.failureCount();
+
+    stringstream ss(line);
     ss >> cmd;
 
     if (cmd == "mkdir") {
         string path;
         ss >> path;
         if (path.empty()) {
-            cout << "Error: Path is missing" << endl;
+            fs.fail() << "Error: Path is missing" << endl;
         }
         else {
             fs.mkdir(path);
@@ -832,7 +4789,7 @@ void executeCommand(const string& command, FileSystem& fs) {
         string path;
         ss >> path;
         if (path.empty()) {
-            cout << "Error: Path is missing" << endl;
+            fs.fail() << "Error: Path is missing" << endl;
         }
         else {
             fs.cd(path);
@@ -842,17 +4799,34 @@ void executeCommand(const string& command, FileSystem& fs) {
         fs.pwd();
     }
     else if (cmd == "ls") {
-        fs.ls();
+        FileSystem::ListOptions options;
+        string path, token;
+        bool valid = true;
+        while (valid && ss >> token) {
+            if (token == "-l") options.longFormat = true;
+            else if (token == "--sort") valid = (ss >> options.sortKey) &&
+                (options.sortKey == "name" || options.sortKey == "mtime" || options.sortKey == "size");
+            else if (token == "--limit") valid = (ss >> options.limit) && options.limit > 0;
+            else if (token == "--after") valid = (bool)(ss >> options.after);
+            else if (path.empty() && token[0] != '-') path = token;
+            else valid = false;
+        }
+        if (!valid) {
+            fs.fail() << "Error: Usage: ls [path] [-l] [--sort name|mtime|size] [--limit N] [--after NAME]" << endl;
+        }
+        else {
+            fs.ls(path, options);
+        }
     }
     else if (cmd == "touch") {
         string path, content;
         ss >> path;
         getline(ss, content); 
         if (path.empty()) {
-            cout << "Error: Path is missing" << endl;
+            fs.fail() << "Error: Path is missing" << endl;
         }
         else {
-            fs.touch(path, content.substr(1)); 
+            fs.touch(path, content.empty() ? content : content.substr(1)); 
         }
     }
     else if (cmd == "write") {
@@ -860,17 +4834,17 @@ void executeCommand(const string& command, FileSystem& fs) {
         ss >> path;
         getline(ss, content); 
         if (path.empty()) {
-            cout << "Error: Path is missing" << endl;
+            fs.fail() << "Error: Path is missing" << endl;
         }
         else {
-            fs.write(path, content.substr(1)); 
+            fs.write(path, content.empty() ? content : content.substr(1)); 
         }
     }
     else if (cmd == "cat") {
         string path;
         ss >> path;
         if (path.empty()) {
-            cout << "Error: Path is missing" << endl;
+            fs.fail() << "Error: Path is missing" << endl;
         }
         else {
             fs.cat(path);
@@ -880,7 +4854,7 @@ void executeCommand(const string& command, FileSystem& fs) {
         string path;
         ss >> path;
         if (path.empty()) {
-            cout << "Error: Path is missing" << endl;
+            fs.fail() << "Error: Path is missing" << endl;
         }
         else {
             fs.rm(path);
@@ -890,7 +4864,7 @@ void executeCommand(const string& command, FileSystem& fs) {
         string src, dest;
         ss >> src >> dest;
         if (src.empty() || dest.empty()) {
-            cout << "Error: Source or destination path is missing" << endl;
+            fs.fail() << "Error: Source or destination path is missing" << endl;
         }
         else {
             fs.mv(src, dest);
@@ -900,7 +4874,10 @@ void executeCommand(const string& command, FileSystem& fs) {
         string src, dest;
         ss >> src >> dest;
         if (src.empty() || dest.empty()) {
-            cout << "Error: Source or destination path is missing" << endl;
+            fs.fail() << "Error: Source or destination path is missing" << endl;
+        }
+        else if (background) {
+            fs.cpAsync(src, dest);
         }
         else {
             fs.cp(src, dest);
@@ -910,40 +4887,219 @@ void executeCommand(const string& command, FileSystem& fs) {
         string path;
         ss >> path;
         if (path.empty()) {
-            cout << "Error: Path is missing" << endl;
+            fs.fail() << "Error: Path is missing" << endl;
         }
         else {
             fs.stat(path);
         }
     }
+    else if (cmd == "du") {
+        string path;
+        ss >> path;
+        fs.du(path);
+    }
+    else if (cmd == "df") {
+        fs.df();
+    }
+    else if (cmd == "quota") {
+        string scope, target;
+        size_t maxBytes = 0, maxInodes = 0;
+        ss >> scope;
+        if (scope.empty()) {
+            fs.quotaReport();
+        }
+        else if ((scope == "user" || scope == "dir") && ss >> target >> maxBytes >> maxInodes) {
+            if (scope == "user") {
+                fs.setOwnerQuota(target, maxBytes, maxInodes);
+            }
+            else {
+                fs.setDirectoryQuota(target, maxBytes, maxInodes);
+            }
+        }
+        else {
+            fs.fail() << "Error: Usage: quota [user <owner>|dir <path> <maxBytes> <maxInodes>]" << endl;
+        }
+    }
+    else if (cmd == "compress") {
+        long long idleSeconds = 0;
+        ss >> idleSeconds;
+        fs.compressCold(idleSeconds);
+    }
+    else if (cmd == "begin") {
+        fs.beginTransaction();
+    }
+    else if (cmd == "commit") {
+        fs.commitTransaction();
+    }
+    else if (cmd == "abort") {
+        fs.abortTransaction();
+    }
+    else if (cmd == "spill") {
+        string target;
+        ss >> target;
+        if (target.empty()) {
+            fs.spillStats();
+        }
+        else if (target == "off") {
+            fs.disableSpill();
+        }
+        else {
+            size_t ceiling = 0;
+            if (!(ss >> ceiling)) {
+                fs.fail() << "Error: Usage: spill [<file> <ceilingBytes> | off]" << endl;
+            }
+            else {
+                fs.enableSpill(target, ceiling);
+            }
+        }
+    }
+    else if (cmd == "watch") {
+        string action, arg;
+        ss >> action >> arg;
+        if (action == "add" && !arg.empty()) {
+            string flag;
+            ss >> flag;
+            fs.addWatch(arg, flag == "-r");
+        }
+        else if ((action == "rm" || action == "tail") && !arg.empty()) {
+            int id = 0;
+            stringstream(arg) >> id;
+            if (action == "rm") fs.removeWatch(id);
+            else fs.tailWatch(id);
+        }
+        else if (action == "list" || action.empty()) {
+            fs.listWatches();
+        }
+        else {
+            fs.fail() << "Error: Usage: watch [list] | watch add <path> [-r] | watch rm <id> | watch tail <id>" << endl;
+        }
+    }
+    else if (cmd == "su") {
+        string user;
+        ss >> user;
+        if (user.empty()) {
+            fs.fail() << "Error: User is missing" << endl;
+        }
+        else {
+            fs.switchUser(user);
+        }
+    }
+    else if (cmd == "whoami") {
+        fs.whoami();
+    }
+    else if (cmd == "snapshot") {
+        string action, name;
+        ss >> action >> name;
+        if (action == "list") {
+            fs.listSnapshots();
+        }
+        else if ((action == "create" || action == "delete") && !name.empty()) {
+            if (action == "create") {
+                fs.createSnapshot(name);
+            }
+            else {
+                fs.deleteSnapshot(name);
+            }
+        }
+        else {
+            fs.fail() << "Error: Usage: snapshot create|delete <name> | snapshot list" << endl;
+        }
+    }
+    else if (cmd == "dedup") {
+        string mode;
+        ss >> mode;
+        if (mode.empty()) {
+            fs.dedupReport();
+        }
+        else if (mode == "on" || mode == "off") {
+            fs.setDedup(mode == "on");
+        }
+        else {
+            fs.fail() << "Error: Usage: dedup [on|off]" << endl;
+        }
+    }
+    else if (cmd == "bulk") {
+        string mode;
+        ss >> mode;
+        if (mode == "begin") {
+            fs.beginBulkLoad();
+        }
+        else if (mode == "end") {
+            fs.endBulkLoad();
+        }
+        else {
+            fs.fail() << "Error: Usage: bulk begin|end" << endl;
+        }
+    }
+    else if (cmd == "lstat") {
+        string path;
+        ss >> path;
+        if (path.empty()) {
+            fs.fail() << "Error: Path is missing" << endl;
+        }
+        else {
+            fs.stat(path, false);
+        }
+    }
     else if (cmd == "save") {
         string filename;
         ss >> filename;
         if (filename.empty()) {
-            cout << "Error: Filename is missing" << endl;
+            fs.fail() << "Error: Filename is missing" << endl;
+        }
+        else if (background) {
+            fs.saveAsync(filename);
         }
         else {
             fs.saveToFile(filename);
         }
     }
+    else if (cmd == "import") {
+        string hostDir, targetPath;
+        ss >> hostDir >> targetPath;
+        if (hostDir.empty() || targetPath.empty()) {
+            fs.fail() << "Error: Usage: import <hostdir> <path>" << endl;
+        }
+        else {
+            fs.importTree(hostDir, targetPath);
+        }
+    }
+    else if (cmd == "export") {
+        string sourcePath, target, flag;
+        unsigned threads = max(1u, min(8u, thread::hardware_concurrency()));
+        ss >> sourcePath >> target >> flag;
+        if (flag == "-j") ss >> threads;
+        if (sourcePath.empty() || target.empty()) {
+            fs.fail() << "Error: Usage: export <path> <hostdir | archive.tar> [-j threads]" << endl;
+        }
+        else {
+            fs.exportTree(sourcePath, target, threads);
+        }
+    }
     else if (cmd == "load") {
         string filename, targetPath;
         ss >> filename >> targetPath;
 
         if (filename.empty()) {
-            cout << "Error: Filename is missing." << endl;
+            fs.fail() << "Error: Filename is missing." << endl;
         }
         else if (targetPath.empty()) {
-            cout << "Error: Target path is missing." << endl;
+            fs.fail() << "Error: Target path is missing." << endl;
         }
         else {
             Node* targetNode = fs.findNode(targetPath);
 
             if (!targetNode) {
-                cout << "Error: Node at path '" << targetPath << "' not found." << endl;
+                fs.fail() << "Error: Node at path '" << targetPath << "' not found." << endl;
+            }
+            else if (fs.isReadOnlyLookup()) {
+                fs.fail() << "Error: Snapshots are read-only" << endl;
             }
             else if (targetNode->isDirectory) {
-                cout << "Error: Cannot load content into a directory." << endl;
+                fs.fail() << "Error: Cannot load content into a directory." << endl;
+            }
+            else if (background) {
+                fs.loadAsync(filename, targetNode);
             }
             else {
                 fs.loadFromFile(filename, targetNode);
@@ -959,7 +5115,7 @@ void executeCommand(const string& command, FileSystem& fs) {
         string oldName, newName;
         ss >> oldName >> newName;
         if (oldName.empty() || newName.empty()) {
-            cout << "Error: Old or new name is missing" << endl;
+            fs.fail() << "Error: Old or new name is missing" << endl;
         }
         else {
             fs.rename(oldName, newName);
@@ -969,7 +5125,10 @@ void executeCommand(const string& command, FileSystem& fs) {
         string path;
         ss >> path;
         if (path.empty()) {
-            cout << "Error: Path is missing" << endl;
+            fs.fail() << "Error: Path is missing" << endl;
+        }
+        else if (background) {
+            fs.rmdirAsync(path);
         }
         else {
             fs.rmdir(path);
@@ -979,7 +5138,7 @@ void executeCommand(const string& command, FileSystem& fs) {
         string target, linkName;
         ss >> target >> linkName;
         if (target.empty() || linkName.empty()) {
-            cout << "Error: Target or link name is missing" << endl;
+            fs.fail() << "Error: Target or link name is missing" << endl;
         }
         else {
             fs.createSymlink(target, linkName);
@@ -988,9 +5147,9 @@ void executeCommand(const string& command, FileSystem& fs) {
     else if (cmd == "chmod") {
         string path;
         unsigned int permissions;
-        ss >> path >> permissions;
+        ss >> path >> oct >> permissions;
         if (path.empty()) {
-            cout << "Error: Path is missing" << endl;
+            fs.fail() << "Error: Path is missing" << endl;
         }
         else {
             fs.chmod(path, permissions);
@@ -1000,7 +5159,7 @@ void executeCommand(const string& command, FileSystem& fs) {
         string path, owner;
         ss >> path >> owner;
         if (path.empty() || owner.empty()) {
-            cout << "Error: Path or owner is missing" << endl;
+            fs.fail() << "Error: Path or owner is missing" << endl;
         }
         else {
             fs.chown(path, owner);
@@ -1010,7 +5169,7 @@ void executeCommand(const string& command, FileSystem& fs) {
         string input;
         ss >> input;
         if (input.empty()) {
-            cout << "Error: Input is missing" << endl;
+            fs.fail() << "Error: Input is missing" << endl;
         }
         else {
             fs.toLower(input);
@@ -1020,7 +5179,7 @@ void executeCommand(const string& command, FileSystem& fs) {
         string path;
         ss >> path;
         if (path.empty()) {
-            cout << "Error: Path is missing" << endl;
+            fs.fail() << "Error: Path is missing" << endl;
         }
         else {
             fs.find(path);
@@ -1030,22 +5189,45 @@ void executeCommand(const string& command, FileSystem& fs) {
         string pattern;
         ss >> pattern;
         if (pattern.empty()) {
-            cout << "Error: Pattern or path is missing" << endl;
+            fs.fail() << "Error: Pattern or path is missing" << endl;
+        }
+        else if (background) {
+            fs.grepAsync(pattern);
         }
         else {
             fs.grep(pattern);
         }
     }
+    else if (cmd == "jobs") {
+        string action;
+        int id = 0;
+        ss >> action;
+        if (action.empty()) {
+            fs.listJobs();
+        }
+        else if (action == "cancel" && ss >> id) {
+            fs.cancelJob(id);
+        }
+        else if (action == "wait") {
+            ss >> id;
+            fs.waitForJobs(id, hold);
+        }
+        else {
+            fs.fail() << "Error: Usage: jobs [cancel <id> | wait [id]]" << endl;
+        }
+    }
     else {
-        cout << "Error: Unknown command" << endl;
+        fs.fail() << "Error: Unknown command" << endl;
     }
+
+    if (fs.failureCount() != failuresBefore && changesTree.count(cmd)) fs.noteFailedChange();
 }
 
 void startCLI(FileSystem& fs) {
     while (true) {
         cout << "> ";
         string command;
-        getline(cin, command);
+        if (!getline(cin, command)) break;
 
         if (command == "exit") {
             cout << "Exiting file system CLI." << endl;
@@ -1060,8 +5242,10 @@ void startCLI(FileSystem& fs) {
     }
 }
 
+#ifndef FILESYSTEM_NO_MAIN
 int main() {
     FileSystem fs;
     startCLI(fs);
     return 0;
 }
+#endif
@@ -0,0 +1,186 @@
+// Benchmarks for the file system, built as their own binary so none of
+// this ships in the CLI:
+//
+//   g++ -std=c++20 -O2 -pthread bench.cpp -o fsbench
+//   ./fsbench unlink <count>
+//   ./fsbench smallfiles <count>
+//
+// The file system is compiled in without its main() and driven through the
+// same public operations the CLI calls, so the numbers include path
+// lookup, permission checks and everything else a real command pays for.
+#define FILESYSTEM_NO_MAIN
+#include "File _System.cpp"
+
+#include <new>
+
+// Counts every heap allocation made through operator new, and the bytes
+// still allocated, which each block records in a header in front of it.
+// The replacement only exists in this binary; the file system itself uses
+// the standard allocator.
+static atomic<size_t> heapAllocations(0);
+static atomic<size_t> heapAllocatedBytes(0);
+static atomic<size_t> heapLiveBytes(0);
+static constexpr size_t blockHeader = alignof(max_align_t);
+
+void* operator new(size_t size) {
+    heapAllocations.fetch_add(1, memory_order_relaxed);
+    heapAllocatedBytes.fetch_add(size, memory_order_relaxed);
+    heapLiveBytes.fetch_add(size, memory_order_relaxed);
+    while (true) {
+        if (char* block = static_cast<char*>(malloc(size + blockHeader))) {
+            *reinterpret_cast<size_t*>(block) = size;
+            return block + blockHeader;
+        }
+        new_handler handler = get_new_handler();
+        if (!handler) throw bad_alloc();
+        handler();
+    }
+}
+
+// Out of line so GCC does not mistake the free() below for a mismatch with
+// the operator new above.
+[[gnu::noinline]] void operator delete(void* block) noexcept {
+    if (!block) return;
+    char* start = static_cast<char*>(block) - blockHeader;
+    heapLiveBytes.fetch_sub(*reinterpret_cast<size_t*>(start), memory_order_relaxed);
+    free(start);
+}
+
+[[gnu::noinline]] void operator delete(void* block, size_t) noexcept {
+    operator delete(block);
+}
+
+// Swallows the per-command messages while a benchmark is timing.
+class NullBuffer : public streambuf {
+protected:
+    int overflow(int c) override { return c; }
+    streamsize xsputn(const char*, streamsize count) override { return count; }
+};
+
+class QuietOutput {
+public:
+    QuietOutput() : saved(cout.rdbuf(&sink)) {}
+    ~QuietOutput() { cout.rdbuf(saved); }
+
+private:
+    NullBuffer sink;
+    streambuf* saved;
+};
+
+// Fills /bench-unlink with `count` empty files and removes them again with
+// rm in creation order.
+static bool benchUnlink(size_t count) {
+    FileSystem fs;
+    vector<string> paths;
+    paths.reserve(count);
+    for (size_t i = 0; i < count; ++i) paths.push_back("/bench-unlink/f" + to_string(i));
+
+    chrono::steady_clock::time_point started, filled, emptied;
+    {
+        QuietOutput quiet;
+        fs.mkdir("/bench-unlink");
+        started = chrono::steady_clock::now();
+        for (const string& path : paths) fs.touch(path);
+        filled = chrono::steady_clock::now();
+        for (const string& path : paths) fs.rm(path);
+        emptied = chrono::steady_clock::now();
+        fs.rmdir("/bench-unlink");
+    }
+    if (fs.failureCount()) {
+        cerr << "Error: " << fs.failureCount() << " operations failed" << endl;
+        return false;
+    }
+
+    double fillSeconds = chrono::duration<double>(filled - started).count();
+    double unlinkSeconds = chrono::duration<double>(emptied - filled).count();
+    ostringstream report;
+    report.setf(ios::fixed);
+    report.precision(3);
+    report << "Created " << count << " files in " << fillSeconds << " s, removed them in "
+           << unlinkSeconds << " s (" << unlinkSeconds * 1e9 / count << " ns per rm)";
+    cout << report.str() << endl;
+    return true;
+}
+
+// Builds `count` files of 1 to 64 bytes under /bench-smallfiles, 1000 per
+// directory, reads them back with cat and removes the tree: first with
+// packing, then with every content in its own string for comparison. Paths
+// are built up front, and the slabs are grown before the first pass, so
+// both passes count only what the file system itself allocates. Besides
+// the allocations made while building, each pass reports what a file
+// costs once built: its node slot, its index entry and the heap bytes
+// still allocated.
+static bool benchSmallFiles(size_t count) {
+    vector<string> dirs;
+    vector<string> paths;
+    paths.reserve(count);
+    for (size_t i = 0; i < count; ++i) {
+        if (i % 1000 == 0) dirs.push_back("/bench-smallfiles/d" + to_string(i / 1000));
+        paths.push_back(dirs.back() + "/f" + to_string(i));
+    }
+    for (NodeSlab* slab : { &nodeSlab(), &entrySlab() }) {
+        vector<void*> slots;
+        for (size_t i = 0; i < count + dirs.size() + 2; ++i) slots.push_back(slab->allocate());
+        for (void* slot : slots) slab->release(slot);
+    }
+
+    for (int pass = 0; pass < 2; ++pass) {
+        FileSystem fs;
+        chrono::steady_clock::time_point started, built, read;
+        size_t allocations, bytes, retained;
+        {
+            QuietOutput quiet;
+            fs.setPacking(pass == 0);
+            fs.mkdir("/bench-smallfiles");
+            string content;
+            content.reserve(64);
+            size_t allocationsBefore = heapAllocations.load();
+            size_t bytesBefore = heapAllocatedBytes.load();
+            size_t liveBefore = heapLiveBytes.load();
+            size_t nodesBefore = nodeSlab().slotsInUse();
+            size_t entriesBefore = entrySlab().slotsInUse();
+            started = chrono::steady_clock::now();
+            for (size_t i = 0; i < count; ++i) {
+                if (i % 1000 == 0) fs.mkdir(dirs[i / 1000]);
+                content.assign(1 + i % 64, (char)('a' + i % 26));
+                fs.touch(paths[i], content);
+            }
+            built = chrono::steady_clock::now();
+            allocations = heapAllocations.load() - allocationsBefore;
+            bytes = heapAllocatedBytes.load() - bytesBefore;
+            retained = heapLiveBytes.load() - liveBefore +
+                (nodeSlab().slotsInUse() - nodesBefore) * sizeof(Node) +
+                (entrySlab().slotsInUse() - entriesBefore) * sizeof(IndexEntry);
+            for (const string& path : paths) fs.cat(path);
+            read = chrono::steady_clock::now();
+            fs.rmdir("/bench-smallfiles");
+        }
+        if (fs.failureCount()) {
+            cerr << "Error: " << fs.failureCount() << " operations failed" << endl;
+            return false;
+        }
+
+        ostringstream report;
+        report.setf(ios::fixed);
+        report.precision(2);
+        report << (pass == 0 ? "packed: " : "plain strings: ") << count << " files in "
+               << chrono::duration<double>(built - started).count() << " s, read back in "
+               << chrono::duration<double>(read - built).count() << " s, "
+               << (double)allocations / count << " allocations and "
+               << (double)bytes / count << " heap bytes per file while building, "
+               << (double)retained / count << " bytes per file once built";
+        cout << report.str() << endl;
+    }
+    cout << "Node slots: " << sizeof(Node) << " bytes, " << nodeSlab().reservedBytes() / 1048576
+         << " MiB reserved; inline contents up to " << string().capacity() << " bytes" << endl;
+    return true;
+}
+
+int main(int argc, char** argv) {
+    string kind = argc > 1 ? argv[1] : "";
+    size_t count = argc > 2 ? strtoull(argv[2], nullptr, 10) : 0;
+    if (kind == "unlink" && count > 0) return benchUnlink(count) ? 0 : 1;
+    if (kind == "smallfiles" && count > 0) return benchSmallFiles(count) ? 0 : 1;
+    cerr << "Usage: fsbench unlink|smallfiles <count>" << endl;
+    return 2;
+}